@@ -20,7 +20,6 @@
 #include <string>
 #include <memory>
 #include <limits>
-#include <map>
 #include <algorithm>
 #include <fstream>
 #include <vector>
@@ -62,6 +61,17 @@ extern "C"
 /// the last error information
 std::string _LastError;
 
+/// allocate a matrix, allowing more than 2^31-1 elements (long vector)
+static SEXP _AllocMatrix(SEXPTYPE type, int nrow, int ncol)
+{
+	SEXP rv = PROTECT(allocVector(type, (R_xlen_t)nrow * ncol));
+	SEXP dim = PROTECT(NEW_INTEGER(2));
+	INTEGER(dim)[0] = nrow; INTEGER(dim)[1] = ncol;
+	setAttrib(rv, R_DimSymbol, dim);
+	UNPROTECT(2);
+	return rv;
+}
+
 
 // ===========================================================
 // the public functions
@@ -183,39 +193,175 @@ SEXP HIBAG_SortAlleleStr(SEXP hlastr)
 
 /// Detect and correct strand problem
 
-static inline bool ATGC(const string &s)
+/// the decisions of strand and allele order
+enum TStrandDecision
+{
+	STRAND_KEEP = 0,     //< the same allele order
+	STRAND_SWITCH,       //< switch the allele order
+	STRAND_AMBIGUITY,    //< strand ambiguity, compare allele frequencies
+	STRAND_MISMATCH      //< mismatching alleles, compare allele frequencies
+};
+
+/// A SNP allele pair "allele1/allele2", case-insensitive
+struct TAllelePair
 {
-	return (s=="A") || (s=="T") || (s=="G") || (s=="C");
+	/// 4*allele1 + allele2 (A=0, C=1, G=2, T=3) if both are A, C, G or T,
+	//    otherwise -1
+	int Code;
+	const char *A1;  //< the first allele
+	const char *A2;  //< the second allele
+	int Len1;        //< the length of the first allele
+	int Len2;        //< the length of the second allele
+
+	void Init(const char *txt)
+	{
+		const char *p = strchr(txt, '/');
+		A1 = txt;
+		if (p != NULL)
+		{
+			Len1 = p - txt;
+			A2 = p + 1; Len2 = strlen(A2);
+		} else {
+			// no a second allele
+			Len1 = strlen(txt);
+			A2 = ""; Len2 = 0;
+		}
+		const int b1 = (Len1 == 1) ? BaseCode(*A1) : -1;
+		const int b2 = (Len2 == 1) ? BaseCode(*A2) : -1;
+		Code = ((b1 >= 0) && (b2 >= 0)) ? (4*b1 + b2) : -1;
+	}
+
+	/// A=0, C=1, G=2, T=3, otherwise -1
+	static inline int BaseCode(char ch)
+	{
+		switch (ch)
+		{
+			case 'A': case 'a': return 0;
+			case 'C': case 'c': return 1;
+			case 'G': case 'g': return 2;
+			case 'T': case 't': return 3;
+			default: return -1;
+		}
+	}
+};
+
+/// whether two alleles are the same, case-insensitive
+static inline bool _AlleleEq(const char *s, int ns, const char *p, int np)
+{
+	if (ns != np) return false;
+	for (int i=0; i < ns; i++)
+		if (toupper(s[i]) != toupper(p[i])) return false;
+	return true;
 }
+
 static inline int ALLELE_MINOR(double freq)
 {
 	return (freq <= 0.5) ? 0 : 1;
 }
-static inline void split_allele(const char *txt, string &allele1, string &allele2)
+
+/// The lookup tables of strand decisions for the pairs of A, C, G and T
+class CStrandTable
 {
-	const char *p = strchr(txt, '/');
-	if (p != NULL)
+public:
+	/// [check_strand][template code][target code] in 'HIBAG_AlleleStrand()'
+	UINT8 Switch[2][16][16];
+	/// [allele1 code][allele2 code] in 'HIBAG_AlleleStrand2()', 1 if valid
+	UINT8 Valid[16][16];
+
+	CStrandTable()
 	{
-		// the first allele
-		allele1.assign(txt, p);
-		for (unsigned int i=0; i < allele1.size(); i++)
-			allele1[i] = toupper(allele1[i]);
-
-		// the second allele	
-		allele2 = p + 1;
-		for (unsigned int i=0; i < allele2.size(); i++)
-			allele2[i] = toupper(allele2[i]);
-	} else {
-		// no a second allele
-		allele1 = txt;
-		for (unsigned int i=0; i < allele1.size(); i++)
-			allele1[i] = toupper(allele1[i]);
-		allele2.clear();
+		// A-T pair, C-G pair
+		static const int COMP[4] = { 3, 2, 1, 0 };
+		for (int S=0; S < 16; S++)
+		{
+			const int s1 = S >> 2, s2 = S & 0x03;
+			for (int P=0; P < 16; P++)
+			{
+				const int p1 = P >> 2, p2 = P & 0x03;
+				for (int check=0; check < 2; check++)
+				{
+					int d = STRAND_KEEP;
+					if ((s1 == p1) && (s2 == p2))
+					{
+						// for example, + C/G <---> - C/G, strand ambi
+						if (check && (s1 == COMP[p2]))
+							d = STRAND_AMBIGUITY;
+					} else if ((s1 == p2) && (s2 == p1))
+					{
+						// for example, + C/G <---> - G/C, strand ambi
+						if (check && (s1 == COMP[p1]))
+							d = STRAND_AMBIGUITY;
+						else
+							d = STRAND_SWITCH;
+					} else if (check)
+					{
+						if ((s1 == COMP[p1]) && (s2 == COMP[p2]))
+						{
+							// for example, + C/G <---> - G/C, strand ambi
+							if (s1 == p2) d = STRAND_AMBIGUITY;
+						} else if ((s1 == COMP[p2]) && (s2 == COMP[p1]))
+							d = STRAND_SWITCH;
+						else
+							d = STRAND_MISMATCH;
+					} else
+						d = STRAND_MISMATCH;
+					Switch[check][S][P] = d;
+				}
+
+				const bool valid = ((s1 == p1) && (s2 == p2)) ||
+					((s1 == p2) && (s2 == p1)) ||
+					((s1 == COMP[p1]) && (s2 == COMP[p2])) ||
+					((s1 == COMP[p2]) && (s2 == COMP[p1]));
+				Valid[S][P] = valid ? 1 : 0;
+			}
+		}
 	}
-}
 
+	/// the decision of 'HIBAG_AlleleStrand()'
+	inline int Decide(const TAllelePair &S, const TAllelePair &P,
+		bool check_strand) const
+	{
+		if ((S.Code >= 0) && (P.Code >= 0))
+			return Switch[check_strand ? 1 : 0][S.Code][P.Code];
+
+		// not A/C/G/T, compare the allele strings
+		const bool s1_s2 = _AlleleEq(S.A1, S.Len1, S.A2, S.Len2);
+		if (_AlleleEq(S.A1, S.Len1, P.A1, P.Len1) &&
+			_AlleleEq(S.A2, S.Len2, P.A2, P.Len2))
+		{
+			return s1_s2 ? STRAND_AMBIGUITY : STRAND_KEEP;
+		} else if (_AlleleEq(S.A1, S.Len1, P.A2, P.Len2) &&
+			_AlleleEq(S.A2, S.Len2, P.A1, P.Len1))
+		{
+			return s1_s2 ? STRAND_AMBIGUITY : STRAND_SWITCH;
+		} else
+			return STRAND_MISMATCH;
+	}
+};
+
+static const CStrandTable _StrandTable;
+
+
+/**
+ *  Detect the strand and allele order of target SNPs according to template
+ *
+ *  \param allele1        the template SNP alleles
+ *  \param afreq1         the template allele frequencies
+ *  \param I1             the template SNP indices (starting from 1)
+ *  \param allele2        the target SNP alleles
+ *  \param afreq2         the target allele frequencies
+ *  \param I2             the target SNP indices (starting from 1)
+ *  \param if_same_strand whether the SNPs are on the same strand
+ *  \param num            the number of SNPs
+ *  \param geno           the target genotypes, or NULL
+ *  \param NumThread      the number of threads
+ *  \return the switch flags, the numbers of strand ambiguity and mismatching
+ *          alleles, and the target genotypes selected by I2 and switched by
+ *          the flags (NULL if 'geno' is NULL)
+**/
 SEXP HIBAG_AlleleStrand(SEXP allele1, SEXP afreq1, SEXP I1,
-	SEXP allele2, SEXP afreq2, SEXP I2, SEXP if_same_strand, SEXP num)
+	SEXP allele2, SEXP afreq2, SEXP I2, SEXP if_same_strand, SEXP num,
+	SEXP geno, SEXP NumThread)
 {
 	double *pAF1 = REAL(afreq1);
 	double *pAF2 = REAL(afreq2);
@@ -223,13 +369,31 @@ SEXP HIBAG_AlleleStrand(SEXP allele1, SEXP afreq1, SEXP I1,
 	int *pI2 = INTEGER(I2);
 	const bool check_strand = (Rf_asLogical(if_same_strand) != TRUE);
 	const int n = Rf_asInteger(num);
+	int nThread = Rf_asInteger(NumThread);
+	if (nThread < 1) nThread = 1;
 
 	CORE_TRY
-		// initialize: A-T pair, C-G pair
-		map<string, string> MAP;
-		MAP["A"] = "T"; MAP["C"] = "G"; MAP["G"] = "C"; MAP["T"] = "A";
+		// encode the allele pairs once, 'STRING_ELT()' in the main thread
+		vector<TAllelePair> S(n), P(n);
+		for (int i=0; i < n; i++)
+		{
+			S[i].Init(CHAR(STRING_ELT(allele1, pI1[i]-1)));
+			P[i].Init(CHAR(STRING_ELT(allele2, pI2[i]-1)));
+		}
 
-		rv_ans = PROTECT(NEW_LIST(3));
+		const bool has_geno = !Rf_isNull(geno);
+		const int n_snp = has_geno ? Rf_nrows(geno) : 0;
+		const int n_samp = has_geno ? Rf_ncols(geno) : 0;
+		if (has_geno)
+		{
+			for (int i=0; i < n; i++)
+			{
+				if ((pI2[i] < 1) || (pI2[i] > n_snp))
+					throw ErrHLA("Invalid SNP index of genotypes.");
+			}
+		}
+
+		rv_ans = PROTECT(NEW_LIST(4));
 
 		SEXP Flag = PROTECT(NEW_LOGICAL(n));
 		SET_ELEMENT(rv_ans, 0, Flag);
@@ -239,147 +403,89 @@ SEXP HIBAG_AlleleStrand(SEXP allele1, SEXP afreq1, SEXP I1,
 		int out_n_mismatch = 0;
 
 		// loop for each SNP
+	#ifdef _OPENMP
+		#pragma omp parallel for schedule(static) num_threads(nThread) \
+			reduction(+:out_n_stand_amb, out_n_mismatch)
+	#endif
 		for (int i=0; i < n; i++)
 		{
-			// if true, need switch strand
-			bool switch_flag = false;
-
-			// if true, need to compare the allele frequencies
-			//   0 -- no switch detect
-			//   1 -- detect whether switch or not for stand ambiguity
-			//   2 -- detect whether switch or not for mismatching alleles
-			int switch_freq_detect = 0;
-
-			// ``ref / nonref alleles''
-			string s1, s2;
-			string p1, p2;
-			split_allele(CHAR(STRING_ELT(allele1, pI1[i]-1)), s1, s2);
-			split_allele(CHAR(STRING_ELT(allele2, pI2[i]-1)), p1, p2);
-
-			// allele frequency
-			const double F1 = pAF1[pI1[i]-1];
-			const double F2 = pAF2[pI2[i]-1];
-
-			if (ATGC(s1) && ATGC(s2) && ATGC(p1) && ATGC(p2))
-			{
-				// check
-				if ( (s1 == p1) && (s2 == p2) )
-				{
-					if (check_strand)
-					{
-						// for example, + C/G <---> - C/G, strand ambi
-						if (s1 == MAP[p2])
-							switch_freq_detect = 1;
-					}
-				} else if ( (s1 == p2) && (s2 == p1) )
-				{
-					if (check_strand)
-					{
-						// for example, + C/G <---> - G/C, strand ambi
-						if (s1 == MAP[p1])
-							switch_freq_detect = 1;
-						else
-							switch_flag = true;
-					} else
-						switch_flag = true;
-				} else {
-					if (check_strand)
-					{
-						if ( (s1 == MAP[p1]) && (s2 == MAP[p2]) )
-						{
-							// for example, + C/G <---> - G/C, strand ambi
-							if (s1 == p2)
-								switch_freq_detect = 1;
-						} else if ( (s1 == MAP[p2]) && (s2 == MAP[p1]) )
-							switch_flag = true;
-						else
-							switch_freq_detect = 2;
-					} else
-						switch_freq_detect = 2;
-				}
-			} else {
-				if ((s1 == p1) && (s2 == p2))
-				{
-					if (s1 == s2)
-						switch_freq_detect = 1;  // ambiguous
-				} else if ((s1 == p2) && (s2 == p1))
-				{
-					if (s1 == s2)
-						switch_freq_detect = 1;  // ambiguous
-					else
-						switch_flag = true;
-				} else
-					switch_freq_detect = 2;
-			}
-
-			if (switch_freq_detect != 0)
+			const int d = _StrandTable.Decide(S[i], P[i], check_strand);
+			bool switch_flag = (d == STRAND_SWITCH);
+			if ((d == STRAND_AMBIGUITY) || (d == STRAND_MISMATCH))
 			{
+				// compare the allele frequencies
+				const double F1 = pAF1[pI1[i]-1];
+				const double F2 = pAF2[pI2[i]-1];
 				switch_flag = (ALLELE_MINOR(F1) != ALLELE_MINOR(F2));
-				if (switch_freq_detect == 1)
+				if (d == STRAND_AMBIGUITY)
 					out_n_stand_amb ++;
 				else
 					out_n_mismatch ++;
 			}
-
 			out_flag[i] = switch_flag;
 		}
 
 		SET_ELEMENT(rv_ans, 1, ScalarInteger(out_n_stand_amb));
 		SET_ELEMENT(rv_ans, 2, ScalarInteger(out_n_mismatch));
+
+		// select the target SNPs, and switch genotypes (2 - g) by the flags
+		if (has_geno)
+		{
+			SEXP G = PROTECT(allocMatrix(INTSXP, n, n_samp));
+			SET_ELEMENT(rv_ans, 3, G);
+			const int *pG = INTEGER(geno);
+			int *pOut = INTEGER(G);
+		#ifdef _OPENMP
+			#pragma omp parallel for schedule(static) num_threads(nThread)
+		#endif
+			for (int j=0; j < n_samp; j++)
+			{
+				const int *g = pG + (size_t)j*n_snp;
+				int *out = pOut + (size_t)j*n;
+				for (int i=0; i < n; i++)
+				{
+					const int v = g[pI2[i]-1];
+					out[i] = (out_flag[i] && (v != NA_INTEGER)) ? (2 - v) : v;
+				}
+			}
+			UNPROTECT(1);
+		}
+
 		UNPROTECT(2);
 
 	CORE_CATCH
 }
 
 
-SEXP HIBAG_AlleleStrand2(SEXP allele1, SEXP allele2)
+SEXP HIBAG_AlleleStrand2(SEXP allele1, SEXP allele2, SEXP NumThread)
 {
 	if (XLENGTH(allele1) != XLENGTH(allele2))
 		error("'allele1' and 'allele2' should have the same length.");
+	int nThread = Rf_asInteger(NumThread);
+	if (nThread < 1) nThread = 1;
 
 	CORE_TRY
-		// initialize: A-T pair, C-G pair
-		map<string, string> MAP;
-		MAP["A"] = "T"; MAP["C"] = "G"; MAP["G"] = "C"; MAP["T"] = "A";
-
 		const int n = XLENGTH(allele1);
-		rv_ans = PROTECT(NEW_LOGICAL(n));
-		int *pValid = LOGICAL(rv_ans);
 
-		// loop for each SNP
+		// encode the allele pairs once, 'STRING_ELT()' in the main thread
+		vector<TAllelePair> S(n), P(n);
 		for (int i=0; i < n; i++)
 		{
-			// if true, need switch strand
-			bool valid = false;
-
-			// ``ref / nonref alleles''
-			string s1, s2;
-			string p1, p2;
-			split_allele(CHAR(STRING_ELT(allele1, i)), s1, s2);
-			split_allele(CHAR(STRING_ELT(allele2, i)), p1, p2);
+			S[i].Init(CHAR(STRING_ELT(allele1, i)));
+			P[i].Init(CHAR(STRING_ELT(allele2, i)));
+		}
 
-			if (ATGC(s1) && ATGC(s2) && ATGC(p1) && ATGC(p2))
-			{
-				// check
-				if ( (s1 == p1) && (s2 == p2) )
-				{
-					valid = true;
-				} else if ( (s1 == p2) && (s2 == p1) )
-				{
-					valid = true;
-				} else {
-					if ( (s1 == MAP[p1]) && (s2 == MAP[p2]) )
-					{
-						// for example, + C/G <---> - G/C, strand ambi
-						valid = true;
-					} else if ( (s1 == MAP[p2]) && (s2 == MAP[p1]) )
-					{
-						valid = true;
-					}
-				}
-			}
+		rv_ans = PROTECT(NEW_LOGICAL(n));
+		int *pValid = LOGICAL(rv_ans);
 
-			pValid[i] = valid;
+		// loop for each SNP, only the pairs of A, C, G and T are valid
+	#ifdef _OPENMP
+		#pragma omp parallel for schedule(static) num_threads(nThread)
+	#endif
+		for (int i=0; i < n; i++)
+		{
+			pValid[i] = (S[i].Code >= 0) && (P[i].Code >= 0) &&
+				_StrandTable.Valid[S[i].Code][P[i].Code];
 		}
 
 		UNPROTECT(1);
@@ -421,6 +527,173 @@ static void _Check_HIBAG_Model(int model)
 }
 
 
+
+// -----------------------------------------------------------------------
+// -----------------------------------------------------------------------
+//
+// Progress information
+//
+
+/// Call an R function with progress information
+class CdProgressRCallback: public CdProgressSink
+{
+public:
+	/// the R function, or R_NilValue
+	SEXP Func;
+
+	CdProgressRCallback() { Func = R_NilValue; }
+
+	virtual void Report(const CdProgression &Prog)
+	{
+		if (Rf_isNull(Func)) return;
+		SEXP info = PROTECT(NEW_LIST(8));
+		SET_ELEMENT(info, 0, mkString(Prog.Info.c_str()));
+		SET_ELEMENT(info, 1, ScalarReal(Prog.Current()));
+		SET_ELEMENT(info, 2, ScalarReal(Prog.Total()));
+		SET_ELEMENT(info, 3,
+			ScalarInteger(Prog.Percent()*CdProgression::StepPercent));
+		SET_ELEMENT(info, 4, ScalarReal(Prog.Elapsed()));
+		SET_ELEMENT(info, 5, ScalarReal(Prog.ETA()));
+		SET_ELEMENT(info, 6, ScalarReal(Prog.Rate()));
+		string unit = Prog.Unit + (Prog.RatePerHour ? "/hour" : "/sec");
+		SET_ELEMENT(info, 7, mkString(unit.c_str()));
+		SEXP nm = PROTECT(NEW_CHARACTER(8));
+		static const char *names[8] = { "info", "current", "total",
+			"percent", "elapsed", "eta", "rate", "unit" };
+		for (int i=0; i < 8; i++)
+			SET_STRING_ELT(nm, i, mkChar(names[i]));
+		setAttrib(info, R_NamesSymbol, nm);
+		SEXP call = PROTECT(Rf_lang2(Func, info));
+		int err = 0;
+		R_tryEval(call, R_GlobalEnv, &err);
+		UNPROTECT(3);
+		// remove the callback on the first error, instead of failing again
+		//   at every report
+		if (err)
+		{
+			R_ReleaseObject(Func);
+			Func = R_NilValue;
+			Rf_warning("The progress callback failed, and it is removed.");
+		}
+	}
+};
+
+/// the sink of R console
+static CdProgressConsole _Progress_Console;
+/// the sink of R callback function
+static CdProgressRCallback _Progress_Callback;
+/// the sink of log file
+static CdProgressLogFile *_Progress_LogFile = NULL;
+/// the minimum interval between two reports
+static double _Progress_Interval = 15;
+
+/// set the sinks of progress object, return true if there is any sink
+static bool _Init_Progress(CdProgression &Prog, bool console)
+{
+	Prog.ClearSink();
+	Prog.Interval = _Progress_Interval;
+	if (console)
+		Prog.AddSink(&_Progress_Console);
+	if (!Rf_isNull(_Progress_Callback.Func))
+		Prog.AddSink(&_Progress_Callback);
+	if (_Progress_LogFile)
+		Prog.AddSink(_Progress_LogFile);
+	return console || !Rf_isNull(_Progress_Callback.Func) ||
+		(_Progress_LogFile != NULL);
+}
+
+
+/**
+ *  Set the progress sinks
+ *
+ *  \param callback     an R function or NULL
+ *  \param log_fn       the file name of log, or ""
+ *  \param interval     the minimum interval (in seconds) between reports
+**/
+SEXP HIBAG_SetProgress(SEXP callback, SEXP log_fn, SEXP interval)
+{
+	const char *fn = CHAR(STRING_ELT(log_fn, 0));
+	double tm = Rf_asReal(interval);
+
+	CORE_TRY
+		if (!Rf_isNull(_Progress_Callback.Func))
+			R_ReleaseObject(_Progress_Callback.Func);
+		_Progress_Callback.Func = R_NilValue;
+		if (!Rf_isNull(callback))
+		{
+			R_PreserveObject(callback);
+			_Progress_Callback.Func = callback;
+		}
+
+		if (_Progress_LogFile)
+		{
+			delete _Progress_LogFile;
+			_Progress_LogFile = NULL;
+		}
+		if (*fn)
+			_Progress_LogFile = new CdProgressLogFile(fn);
+
+		// Inf: only report the start and the completion
+		_Progress_Interval = (ISNAN(tm) || (tm < 0)) ? 0 : tm;
+	CORE_CATCH
+}
+
+
+
+// -----------------------------------------------------------------------
+// -----------------------------------------------------------------------
+//
+// Memory accounting
+//
+
+/**
+ *  Get the current and peak memory usage of each subsystem
+ *
+ *  \param reset        whether resetting the peak usage after the call
+ *  \return a list of subsystem names, current and peak usage in bytes,
+ *      and the memory budget
+**/
+SEXP HIBAG_MemUsage(SEXP reset)
+{
+	CORE_TRY
+		rv_ans = PROTECT(NEW_LIST(4));
+		SEXP nm = PROTECT(NEW_CHARACTER(MEM_NUM_SUBSYSTEM));
+		SET_ELEMENT(rv_ans, 0, nm);
+		SEXP cur = PROTECT(NEW_NUMERIC(MEM_NUM_SUBSYSTEM));
+		SET_ELEMENT(rv_ans, 1, cur);
+		SEXP peak = PROTECT(NEW_NUMERIC(MEM_NUM_SUBSYSTEM));
+		SET_ELEMENT(rv_ans, 2, peak);
+		SET_ELEMENT(rv_ans, 3, ScalarReal(MemAccount.Budget));
+
+		for (int i=0; i < MEM_NUM_SUBSYSTEM; i++)
+		{
+			TMemSubsystem sub = (TMemSubsystem)i;
+			SET_STRING_ELT(nm, i, mkChar(CdMemAccount::Name(sub)));
+			REAL(cur)[i] = MemAccount.Current(sub);
+			REAL(peak)[i] = MemAccount.Peak(sub);
+		}
+		if (Rf_asLogical(reset) == TRUE)
+			MemAccount.ResetPeak();
+
+		UNPROTECT(4);
+	CORE_CATCH
+}
+
+
+/**
+ *  Set the memory budget
+ *
+ *  \param budget       the memory budget in bytes, 0 for no limit
+**/
+SEXP HIBAG_SetMemBudget(SEXP budget)
+{
+	double b = Rf_asReal(budget);
+	CORE_TRY
+		MemAccount.Budget = (R_finite(b) && (b > 0)) ? (size_t)b : 0;
+	CORE_CATCH
+}
+
+
 /**
  *  Build a HIBAG model
  *
@@ -442,8 +715,15 @@ SEXP HIBAG_New(SEXP nSamp, SEXP nSNP, SEXP nHLA)
 
 	CORE_TRY
 		int model = _Need_New_HIBAG_Model();
-		_HIBAG_MODELS_[model] = new CAttrBag_Model;
-		_HIBAG_MODELS_[model]->InitTraining(NumSNP, NumSamp, NumHLA);
+		CAttrBag_Model *m = new CAttrBag_Model;
+		try {
+			m->InitTraining(NumSNP, NumSamp, NumHLA);
+		} catch (...) {
+			// e.g., out of the memory budget
+			delete m;
+			throw;
+		}
+		_HIBAG_MODELS_[model] = m;
 		rv_ans = ScalarInteger(model);
 	CORE_CATCH
 }
@@ -463,12 +743,22 @@ SEXP HIBAG_New(SEXP nSamp, SEXP nSNP, SEXP nHLA)
 SEXP HIBAG_Training(SEXP nSNP, SEXP nSamp, SEXP snp_geno,
 	SEXP nHLA, SEXP H1, SEXP H2)
 {
+	if (XLENGTH(snp_geno) != (R_xlen_t)Rf_asInteger(nSNP)*Rf_asInteger(nSamp))
+		error("Invalid length of SNP genotypes.");
+
 	CORE_TRY
 		int model = _Need_New_HIBAG_Model();
-		_HIBAG_MODELS_[model] = new CAttrBag_Model;
-		_HIBAG_MODELS_[model]->InitTraining(Rf_asInteger(nSNP),
-			Rf_asInteger(nSamp), INTEGER(snp_geno),
-			Rf_asInteger(nHLA), INTEGER(H1), INTEGER(H2));
+		CAttrBag_Model *m = new CAttrBag_Model;
+		try {
+			m->InitTraining(Rf_asInteger(nSNP), Rf_asInteger(nSamp),
+				INTEGER(snp_geno), Rf_asInteger(nHLA), INTEGER(H1),
+				INTEGER(H2));
+		} catch (...) {
+			// e.g., out of the memory budget
+			delete m;
+			throw;
+		}
+		_HIBAG_MODELS_[model] = m;
 		rv_ans = ScalarInteger(model);
 	CORE_CATCH
 }
@@ -500,20 +790,111 @@ SEXP HIBAG_Close(SEXP model)
  *  \param prune           if TRUE, perform a parsimonious forward variable selection
  *  \param verbose         show information if TRUE
  *  \param verbose_detail  show more information if TRUE
+ *  \param trace           record the training trace if TRUE
+ *  \param screen          the fraction of candidate SNPs evaluated by EM
+ *  \param halving         if TRUE, evaluate candidates by successive halving
+ *  \param snp_weight      the weights of sampling candidate SNPs, or NULL
+ *  \param stop_tol        the tolerance of the ensemble out-of-bag accuracy
+ *                         to stop training, 0 for a fixed number of classifiers
+ *  \param max_time        the time limit of training in seconds
+ *  \return the ensemble out-of-bag accuracy after each classifier if
+ *          stop_tol > 0, otherwise NULL
 **/
 SEXP HIBAG_NewClassifiers(SEXP model, SEXP nclassifier, SEXP mtry,
-	SEXP prune, SEXP verbose, SEXP verbose_detail)
+	SEXP prune, SEXP verbose, SEXP verbose_detail, SEXP trace, SEXP screen,
+	SEXP halving, SEXP snp_weight, SEXP stop_tol, SEXP max_time)
 {
 	CORE_TRY
 		int midx = Rf_asInteger(model);
 		_Check_HIBAG_Model(midx);
 
+		if (!Rf_isNull(snp_weight) &&
+			(XLENGTH(snp_weight) != _HIBAG_MODELS_[midx]->nSNP()))
+		{
+			throw ErrHLA("Invalid length of SNP weights.");
+		}
+
+		_HIBAG_MODELS_[midx]->SetScreen(Rf_asReal(screen));
+		_HIBAG_MODELS_[midx]->SetHalving(Rf_asLogical(halving) == TRUE);
+		_HIBAG_MODELS_[midx]->SetSNPWeight(
+			Rf_isNull(snp_weight) ? NULL : REAL(snp_weight));
+		_HIBAG_MODELS_[midx]->SetEnsembleStop(Rf_asReal(stop_tol),
+			Rf_asReal(max_time));
+
+		_Init_Progress(_HIBAG_MODELS_[midx]->Progress(), false);
 		GetRNGstate();
 		_HIBAG_MODELS_[midx]->BuildClassifiers(
 			Rf_asInteger(nclassifier), Rf_asInteger(mtry),
 			Rf_asLogical(prune) == TRUE, Rf_asLogical(verbose) == TRUE,
-			Rf_asLogical(verbose_detail) == TRUE);
+			Rf_asLogical(verbose_detail) == TRUE,
+			Rf_asLogical(trace) == TRUE);
 		PutRNGstate();
+
+		const vector<double> &Acc = _HIBAG_MODELS_[midx]->EnsembleAccuracy();
+		if (!Acc.empty())
+		{
+			rv_ans = NEW_NUMERIC(Acc.size());
+			memcpy(REAL(rv_ans), &Acc[0], sizeof(double)*Acc.size());
+		}
+	CORE_CATCH
+}
+
+
+/**
+ *  Get the training trace of forward-selection steps
+ *
+ *  \param model        the model index
+ *  \return a list of columns, one row per selection step
+**/
+SEXP HIBAG_GetTrainingTrace(SEXP model)
+{
+	int midx = Rf_asInteger(model);
+	CORE_TRY
+		_Check_HIBAG_Model(midx);
+		const vector<TSearchTrace> &Trace =
+			_HIBAG_MODELS_[midx]->TrainingTrace();
+		const int n = Trace.size();
+
+		rv_ans = PROTECT(NEW_LIST(18));
+		int *pI[12];
+		for (int j=0; j < 12; j++)
+		{
+			SEXP v = NEW_INTEGER(n);
+			SET_ELEMENT(rv_ans, j, v);
+			pI[j] = INTEGER(v);
+		}
+		double *pD[6];
+		for (int j=0; j < 6; j++)
+		{
+			SEXP v = NEW_NUMERIC(n);
+			SET_ELEMENT(rv_ans, 12 + j, v);
+			pD[j] = REAL(v);
+		}
+
+		for (int i=0; i < n; i++)
+		{
+			const TSearchTrace &T = Trace[i];
+			pI[0][i] = T.Classifier + 1;
+			pI[1][i] = T.Step + 1;
+			pI[2][i] = T.NumCandidate;
+			pI[3][i] = T.NumEvaluated;
+			pI[4][i] = T.NumPruned;
+			pI[5][i] = T.SumEMIter;
+			pI[6][i] = T.MaxEMIter;
+			pI[7][i] = T.NumHaplo;
+			pI[8][i] = T.NumDoubleHaplo;
+			pI[9][i] = T.SumReducedHaplo;
+			pI[10][i] = T.NumPair;
+			pI[11][i] = (T.NewSNP >= 0) ? (T.NewSNP + 1) : NA_INTEGER;
+			pD[0][i] = T.OutOfBagAcc;
+			pD[1][i] = T.Loss;
+			pD[2][i] = T.TimePrepare;
+			pD[3][i] = T.TimeEM;
+			pD[4][i] = T.TimeOutOfBag;
+			pD[5][i] = T.TimeInBag;
+		}
+
+		UNPROTECT(1);
 	CORE_CATCH
 }
 
@@ -525,32 +906,52 @@ SEXP HIBAG_NewClassifiers(SEXP model, SEXP nclassifier, SEXP mtry,
  *  \param GenoMat      the pointer to the SNP genotypes
  *  \param nSamp        the number of samples in GenoMat
  *  \param vote_method  the voting method
+ *  \param prune_tol    the tolerance of pruning haplotype pairs
+ *  \param epsilon      the max error of posterior probabilities, 0 for exact
+ *  \param early_exit   the tolerance of the early exit, 0 for no early exit
  *  \param ShowInfo     whether showing information
- *  \return H1, H2 and posterior prob.
+ *  \return H1, H2, posterior prob., error bounds and numbers of classifiers
 **/
 SEXP HIBAG_Predict_Resp(SEXP model, SEXP GenoMat, SEXP nSamp,
-	SEXP vote_method, SEXP ShowInfo)
+	SEXP vote_method, SEXP prune_tol, SEXP epsilon, SEXP early_exit,
+	SEXP ShowInfo)
 {
 	int midx = Rf_asInteger(model);
 	int NumSamp = Rf_asInteger(nSamp);
+	double PruneTol = Rf_asReal(prune_tol);
+	double Epsilon = Rf_asReal(epsilon);
+	double EarlyExit = Rf_asReal(early_exit);
 
 	CORE_TRY
 		_Check_HIBAG_Model(midx);
 		CAttrBag_Model &M = *_HIBAG_MODELS_[midx];
+		if (XLENGTH(GenoMat) != (R_xlen_t)M.nSNP() * NumSamp)
+			throw ErrHLA("Invalid length of SNP genotypes.");
 
-		rv_ans = PROTECT(NEW_LIST(3));
+		CdMemUsage MemOut(MEM_OUTPUT);
+		MemOut.Set((size_t)NumSamp * (3*sizeof(int) + 2*sizeof(double)));
+
+		rv_ans = PROTECT(NEW_LIST(5));
 		SEXP out_H1 = PROTECT(NEW_INTEGER(NumSamp));
 		SET_ELEMENT(rv_ans, 0, out_H1);
 		SEXP out_H2 = PROTECT(NEW_INTEGER(NumSamp));
 		SET_ELEMENT(rv_ans, 1, out_H2);
 		SEXP out_Prob = PROTECT(NEW_NUMERIC(NumSamp));
 		SET_ELEMENT(rv_ans, 2, out_Prob);
-
+		SEXP out_Err = PROTECT(NEW_NUMERIC(NumSamp));
+		SET_ELEMENT(rv_ans, 3, out_Err);
+		SEXP out_NumCls = PROTECT(NEW_INTEGER(NumSamp));
+		SET_ELEMENT(rv_ans, 4, out_NumCls);
+
+		M.Prediction().SetPruneTol(PruneTol);
+		M.Prediction().SetEpsilon(Epsilon);
+		M.SetEarlyExit(EarlyExit);
+		bool show = _Init_Progress(M.Progress(), Rf_asLogical(ShowInfo)==TRUE);
 		M.PredictHLA(INTEGER(GenoMat), NumSamp, Rf_asInteger(vote_method),
 			INTEGER(out_H1), INTEGER(out_H2), REAL(out_Prob),
-			NULL, Rf_asLogical(ShowInfo) == TRUE);
+			NULL, REAL(out_Err), INTEGER(out_NumCls), show);
 
-		UNPROTECT(4);
+		UNPROTECT(6);
 	CORE_CATCH
 }
 
@@ -563,20 +964,34 @@ SEXP HIBAG_Predict_Resp(SEXP model, SEXP GenoMat, SEXP nSamp,
  *  \param GenoMat      the pointer to the SNP genotypes
  *  \param nSamp        the number of samples in GenoMat
  *  \param vote_method  the voting method
+ *  \param prune_tol    the tolerance of pruning haplotype pairs
+ *  \param epsilon      the max error of posterior probabilities, 0 for exact
+ *  \param early_exit   the tolerance of the early exit, 0 for no early exit
  *  \param ShowInfo     whether showing information
- *  \return H1, H2, prob. and a matrix of all probabilities
+ *  \return H1, H2, prob., a matrix of all probabilities, error bounds and
+ *      numbers of classifiers
 **/
 SEXP HIBAG_Predict_Resp_Prob(SEXP model, SEXP GenoMat, SEXP nSamp,
-	SEXP vote_method, SEXP ShowInfo)
+	SEXP vote_method, SEXP prune_tol, SEXP epsilon, SEXP early_exit,
+	SEXP ShowInfo)
 {
 	int midx = Rf_asInteger(model);
 	int NumSamp = Rf_asInteger(nSamp);
+	double PruneTol = Rf_asReal(prune_tol);
+	double Epsilon = Rf_asReal(epsilon);
+	double EarlyExit = Rf_asReal(early_exit);
 
 	CORE_TRY
 		_Check_HIBAG_Model(midx);
 		CAttrBag_Model &M = *_HIBAG_MODELS_[midx];
+		if (XLENGTH(GenoMat) != (R_xlen_t)M.nSNP() * NumSamp)
+			throw ErrHLA("Invalid length of SNP genotypes.");
 
-		rv_ans = PROTECT(NEW_LIST(4));
+		CdMemUsage MemOut(MEM_OUTPUT);
+		MemOut.Set((size_t)NumSamp * (3*sizeof(int) + 2*sizeof(double) +
+			sizeof(double)*M.nHLA()*(M.nHLA()+1)/2));
+
+		rv_ans = PROTECT(NEW_LIST(6));
 
 		SEXP out_H1 = PROTECT(NEW_INTEGER(NumSamp));
 		SET_ELEMENT(rv_ans, 0, out_H1);
@@ -585,14 +1000,22 @@ SEXP HIBAG_Predict_Resp_Prob(SEXP model, SEXP GenoMat, SEXP nSamp,
 		SEXP out_Prob = PROTECT(NEW_NUMERIC(NumSamp));
 		SET_ELEMENT(rv_ans, 2, out_Prob);
 		SEXP out_MatProb = PROTECT(
-			allocMatrix(REALSXP, M.nHLA()*(M.nHLA()+1)/2, NumSamp));
+			_AllocMatrix(REALSXP, M.nHLA()*(M.nHLA()+1)/2, NumSamp));
 		SET_ELEMENT(rv_ans, 3, out_MatProb);
-
+		SEXP out_Err = PROTECT(NEW_NUMERIC(NumSamp));
+		SET_ELEMENT(rv_ans, 4, out_Err);
+		SEXP out_NumCls = PROTECT(NEW_INTEGER(NumSamp));
+		SET_ELEMENT(rv_ans, 5, out_NumCls);
+
+		M.Prediction().SetPruneTol(PruneTol);
+		M.Prediction().SetEpsilon(Epsilon);
+		M.SetEarlyExit(EarlyExit);
+		bool show = _Init_Progress(M.Progress(), Rf_asLogical(ShowInfo)==TRUE);
 		M.PredictHLA(INTEGER(GenoMat), NumSamp, Rf_asInteger(vote_method),
 			INTEGER(out_H1), INTEGER(out_H2), REAL(out_Prob),
-			REAL(out_MatProb), Rf_asLogical(ShowInfo) == TRUE);
+			REAL(out_MatProb), REAL(out_Err), INTEGER(out_NumCls), show);
 
-		UNPROTECT(5);
+		UNPROTECT(7);
 	CORE_CATCH
 }
 
@@ -713,6 +1136,91 @@ SEXP HIBAG_Classifier_GetHaplos(SEXP model, SEXP idx)
 }
 
 
+/// the max number of iterations of the confusion EM algorithm
+static const int CONFUSION_EM_MAX_ITER = 100;
+/// the convergence tolerance of the confusion EM algorithm (max abs change)
+static const double CONFUSION_EM_TOL = 1e-10;
+
+/**
+ *  The EM algorithm of the confusion matrix, resolving the double confusions;
+ *    only the cells of the double confusions are updated, and the iterations
+ *    stop once the max change is not greater than CONFUSION_EM_TOL
+ *
+ *  \param nHLA       the number of unique HLA alleles
+ *  \param init_mat   the confusion matrix without the double confusions
+ *  \param nDConf     the number of double confusions
+ *  \param D_mat      the true and predicted alleles of the double confusions
+ *  \param out_mat    the output confusion matrix
+**/
+static void _ConfusionEM(int nHLA, const double init_mat[], int nDConf,
+	const int D_mat[], double out_mat[])
+{
+	#define INDEX(T, P)    ((nHLA+1)*(T) + (P))
+
+	memcpy(out_mat, init_mat, sizeof(double)*nHLA*(nHLA+1));
+	if (nDConf <= 0) return;
+
+	// the cells of the double confusions, (T1,P1), (T1,P2), (T2,P1), (T2,P2)
+	vector<int> Cell(4*nDConf);
+	for (int i=0; i < nDConf; i++)
+	{
+		const int *T = D_mat + i*4;
+		const int *P = D_mat + i*4 + 2;
+		Cell[4*i + 0] = INDEX(T[0], P[0]);
+		Cell[4*i + 1] = INDEX(T[0], P[1]);
+		Cell[4*i + 2] = INDEX(T[1], P[0]);
+		Cell[4*i + 3] = INDEX(T[1], P[1]);
+	}
+	vector<int> UCell(Cell);
+	std::sort(UCell.begin(), UCell.end());
+	UCell.erase(std::unique(UCell.begin(), UCell.end()), UCell.end());
+	const int nU = UCell.size();
+	for (size_t i=0; i < Cell.size(); i++)
+	{
+		Cell[i] = std::lower_bound(UCell.begin(), UCell.end(), Cell[i]) -
+			UCell.begin();
+	}
+
+	// initial values
+	vector<double> Cur(nU), Old(nU);
+	for (int u=0; u < nU; u++) Cur[u] = init_mat[UCell[u]];
+	for (size_t i=0; i < Cell.size(); i++) Cur[Cell[i]] += 0.5;
+
+	// EM update ...
+	for (int iter=0; iter < CONFUSION_EM_MAX_ITER; iter++)
+	{
+		double f1, f2, s;
+		// copy the current probabilities to the old ones
+		Old.swap(Cur);
+		for (int u=0; u < nU; u++) Cur[u] = init_mat[UCell[u]];
+		// update ...
+		for (int i=0; i < nDConf; i++)
+		{
+			const int *c = &Cell[4*i];
+
+			f1 = Old[c[0]]; f2 = Old[c[1]];
+			s = 1.0 / (f1 + f2);
+			Cur[c[0]] += f1 * s;
+			Cur[c[1]] += f2 * s;
+
+			f1 = Old[c[2]]; f2 = Old[c[3]];
+			s = 1.0 / (f1 + f2);
+			Cur[c[2]] += f1 * s;
+			Cur[c[3]] += f2 * s;
+		}
+		// check convergence
+		double diff = 0;
+		for (int u=0; u < nU; u++)
+			diff = std::max(diff, fabs(Cur[u] - Old[u]));
+		if (diff <= CONFUSION_EM_TOL) break;
+	}
+
+	for (int u=0; u < nU; u++) out_mat[UCell[u]] = Cur[u];
+
+	#undef INDEX
+}
+
+
 /**
  *  Estimate the confusion matrix
  *
@@ -725,63 +1233,457 @@ SEXP HIBAG_Classifier_GetHaplos(SEXP model, SEXP idx)
 SEXP HIBAG_Confusion(SEXP n_hla, SEXP init_mat, SEXP n_DConfusion,
 	SEXP D_mat)
 {
-	// the max number of iterations
-	const int N_MAX_ITERATION = 100;
 	// the number of unique HLA alleles
 	const int nHLA = Rf_asInteger(n_hla);
 	// the number of double confusions
 	const int nDConf = Rf_asInteger(n_DConfusion);
 
 	CORE_TRY
-		const size_t SIZE_MAT = sizeof(double)*nHLA*(nHLA+1);
+		rv_ans = allocMatrix(REALSXP, nHLA+1, nHLA);
+		_ConfusionEM(nHLA, REAL(init_mat), nDConf, INTEGER(D_mat),
+			REAL(rv_ans));
+	CORE_CATCH
+}
 
-		#define INDEX(T, P, var) var[(nHLA+1)*T + P]
 
-		rv_ans = allocMatrix(REALSXP, nHLA+1, nHLA);
-		double *out_mat = REAL(rv_ans);
+/// The counts of comparing true and predicted HLA types, as 'hlaCompareAllele()'
+struct TCompareCount
+{
+	int NumInd;               //< the number of valid individuals
+	int CrtInd;               //< the number of correct individuals
+	int CrtHaplo;             //< the number of correct alleles
+	int NumCall;              //< the number of called individuals
+	vector<double> TrueNumAll;  //< the true alleles of valid individuals
+	vector<double> TrueNum;     //< the true alleles of called individuals
+	vector<double> PredNum;     //< the predicted alleles, and "..." at the end
+	vector<double> Confusion;   //< (n_allele+1) x n_allele, without double confusions
+	vector<int> DConf;          //< the true and predicted alleles of double confusions
+};
 
-		vector<double> TmpMat(nHLA*(nHLA+1));
-		double *tmp_mat = &TmpMat[0];
+/**
+ *  Count the true and predicted HLA types of n individuals
+ *
+ *  \param n          the number of individuals
+ *  \param m          the number of alleles
+ *  \param T1         the true allele 1 (0 .. m-1), or < 0 to exclude
+ *  \param T2         the true allele 2
+ *  \param P1         the predicted allele 1 (0 .. m, m for others), or NA_INTEGER
+ *  \param P2         the predicted allele 2
+ *  \param Prob       the probabilities of the predictions, or NULL
+ *  \param threshold  the call threshold, used if Prob != NULL
+ *  \param Out        the output counts
+ *  \param OutAcc     the accuracy of each individual (0, 0.5 or 1), NaN if
+ *                    not called, or NULL
+**/
+static void _CompareCount(int n, int m, const int T1[], const int T2[],
+	const int P1[], const int P2[], const double Prob[], double threshold,
+	TCompareCount &Out, double OutAcc[]=NULL)
+{
+	Out.NumInd = Out.CrtInd = Out.CrtHaplo = Out.NumCall = 0;
+	Out.TrueNumAll.assign(m, 0);
+	Out.TrueNum.assign(m, 0);
+	Out.PredNum.assign(m+1, 0);
+	Out.Confusion.assign((m+1)*m, 0);
+	Out.DConf.clear();
 
-		// initial values
-		memcpy(out_mat, REAL(init_mat), SIZE_MAT);
-		for (int i=0; i < nDConf; i++)
+	#define CONF(P, T)    Out.Confusion[(m+1)*(T) + (P)]
+
+	for (int i=0; i < n; i++)
+	{
+		if (OutAcc) OutAcc[i] = R_NaN;
+		const int s1 = T1[i], s2 = T2[i];
+		int p1 = P1[i], p2 = P2[i];
+		if ((s1 < 0) || (s2 < 0) || (p1 == NA_INTEGER) || (p2 == NA_INTEGER))
+			continue;
+		Out.NumInd ++;
+		Out.TrueNumAll[s1] ++; Out.TrueNumAll[s2] ++;
+		if (Prob && !(Prob[i] >= threshold)) continue;
+
+		Out.TrueNum[s1] ++; Out.TrueNum[s2] ++;
+		Out.PredNum[p1] ++; Out.PredNum[p2] ++;
+		if (((s1==p1) && (s2==p2)) || ((s2==p1) && (s1==p2)))
+			Out.CrtInd ++;
+
+		// count of correct alleles
+		int hnum = 0;
+		if ((s1==p1) || (s1==p2))
 		{
-			int *T = INTEGER(D_mat) + i*4;
-			int *P = INTEGER(D_mat) + i*4 + 2;
-			INDEX(T[0], P[0], out_mat) += 0.5;
-			INDEX(T[0], P[1], out_mat) += 0.5;
-			INDEX(T[1], P[0], out_mat) += 0.5;
-			INDEX(T[1], P[1], out_mat) += 0.5;
+			if (s1==p1) p1 = -1; else p2 = -1;
+			CONF(s1, s1) ++;
+			hnum ++;
 		}
+		if ((s2==p1) || (s2==p2))
+		{
+			CONF(s2, s2) ++;
+			hnum ++;
+		}
+		Out.CrtHaplo += hnum;
+		if (OutAcc) OutAcc[i] = 0.5*hnum;
 
-		// EM update ...
-		for (int iter=0; iter < N_MAX_ITERATION; iter++)
+		// for confusion matrix
+		p1 = P1[i]; p2 = P2[i];
+		if (hnum == 1)
 		{
-			double f1, f2, s;
-			// copy the current probabilities to the old ones
-			memcpy(tmp_mat, out_mat, SIZE_MAT);
-			// update ...
-			memcpy(out_mat, REAL(init_mat), SIZE_MAT);
-			for (int i=0; i < nDConf; i++)
+			if ((s1==p1) || (s1==p2))
 			{
-				int *T = INTEGER(D_mat) + i*4;
-				int *P = INTEGER(D_mat) + i*4 + 2;
-
-				f1 = INDEX(T[0], P[0], tmp_mat);
-				f2 = INDEX(T[0], P[1], tmp_mat);
-				s = 1.0 / (f1 + f2);
-				INDEX(T[0], P[0], out_mat) += f1 * s;
-				INDEX(T[0], P[1], out_mat) += f2 * s;
-
-				f1 = INDEX(T[1], P[0], tmp_mat);
-				f2 = INDEX(T[1], P[1], tmp_mat);
-				s = 1.0 / (f1 + f2);
-				INDEX(T[1], P[0], out_mat) += f1 * s;
-				INDEX(T[1], P[1], out_mat) += f2 * s;
+				if (s1==p1) CONF(p2, s2) ++; else CONF(p1, s2) ++;
+			} else {
+				if (s2==p1) CONF(p2, s1) ++; else CONF(p1, s1) ++;
 			}
+		} else if (hnum == 0)
+		{
+			Out.DConf.push_back(s1); Out.DConf.push_back(s2);
+			Out.DConf.push_back(p1); Out.DConf.push_back(p2);
 		}
 
+		Out.NumCall ++;
+	}
+
+	#undef CONF
+}
+
+/**
+ *  The statistics of comparing true and predicted HLA types, as
+ *    'hlaCompareAllele()'
+ *
+ *  \param C           the counts from '_CompareCount'
+ *  \param threshold   the call threshold, NaN for no threshold
+ *  \param OutOverall  total.num.ind, crt.num.ind, crt.num.haplo, acc.ind,
+ *                     acc.haplo, call.threshold, n.call and call.rate
+ *  \param OutConf     the confusion matrix, (m+1) x m, rounded to 2 digits
+ *  \param OutDetail   m x 6: call.rate, accuracy, sensitivity, specificity,
+ *                     ppv and npv
+**/
+static void _CompareStat(const TCompareCount &C, double threshold,
+	double OutOverall[], double OutConf[], double OutDetail[])
+{
+	const int m = C.TrueNum.size();
+	const int n = C.NumInd, cnt_call = C.NumCall;
+
+	// overall
+	OutOverall[0] = n;
+	OutOverall[1] = C.CrtInd;
+	OutOverall[2] = C.CrtHaplo;
+	OutOverall[3] = double(C.CrtInd) / cnt_call;
+	OutOverall[4] = 0.5*C.CrtHaplo / cnt_call;
+	if (R_finite(threshold))
+	{
+		OutOverall[5] = threshold;
+		OutOverall[6] = cnt_call;
+		OutOverall[7] = double(cnt_call) / n;
+	} else {
+		OutOverall[5] = 0;
+		OutOverall[6] = n;
+		OutOverall[7] = 1.0;
+	}
+
+	// confusion matrix
+	if (m <= 0) return;
+	_ConfusionEM(m, &C.Confusion[0], C.DConf.size()/4,
+		C.DConf.empty() ? NULL : &C.DConf[0], OutConf);
+	for (int i=0; i < (m+1)*m; i++)
+		OutConf[i] = fround(OutConf[i], 2);
+
+	// detail -- sensitivity and specificity
+	for (int a=0; a < m; a++)
+	{
+		const double TrueNum = C.TrueNum[a];
+		const double diag = OutConf[(m+1)*a + a];
+		long double rsum = 0;
+		for (int t=0; t < m; t++) rsum += OutConf[(m+1)*t + a];
+		const double rowsum = rsum;
+
+		double call_rate = TrueNum / C.TrueNumAll[a];
+		if (!R_finite(call_rate)) call_rate = 0;
+		double sens = diag / TrueNum;
+		double spec = 1 - (C.PredNum[a] - diag) / (2.0*cnt_call - TrueNum);
+		double acc = (sens*TrueNum + spec*(2.0*cnt_call - TrueNum)) /
+			(2.0*cnt_call);
+		double ppv = diag / rowsum;
+		double npv = 1 - (TrueNum - diag) / (2.0*n - rowsum);
+		if (call_rate <= 0)
+			sens = spec = ppv = npv = acc = R_NaN;
+
+		OutDetail[a] = call_rate;
+		OutDetail[a + m] = acc;
+		OutDetail[a + 2*m] = sens;
+		OutDetail[a + 3*m] = spec;
+		OutDetail[a + 4*m] = ppv;
+		OutDetail[a + 5*m] = npv;
+	}
+}
+
+
+/**
+ *  Compare the true and predicted HLA types, as 'hlaCompareAllele()'
+ *
+ *  \param n_allele       the number of alleles
+ *  \param T1             the true allele 1 (0 .. n_allele-1), or NA
+ *  \param T2             the true allele 2
+ *  \param P1             the predicted allele 1 (0 .. n_allele, n_allele for
+ *                        the alleles not in comparison), or NA
+ *  \param P2             the predicted allele 2
+ *  \param prob           the probabilities of the predictions, or NULL
+ *  \param call_threshold the call threshold, NaN for no threshold
+ *  \return the overall statistics, the confusion matrix, the details, the
+ *          numbers of valid alleles, and the accuracies of individuals
+**/
+SEXP HIBAG_CompareAllele(SEXP n_allele, SEXP T1, SEXP T2, SEXP P1, SEXP P2,
+	SEXP prob, SEXP call_threshold)
+{
+	const int m = Rf_asInteger(n_allele);
+	const int n = Rf_length(T1);
+	const double threshold = Rf_asReal(call_threshold);
+
+	CORE_TRY
+		if ((m == NA_INTEGER) || (m < 0))
+			throw ErrHLA("Invalid number of HLA alleles.");
+		if ((Rf_length(T2) != n) || (Rf_length(P1) != n) || (Rf_length(P2) != n))
+			throw ErrHLA("Invalid length of HLA types.");
+		if (!Rf_isNull(prob) && (Rf_length(prob) != n))
+			throw ErrHLA("Invalid length of probabilities.");
+
+		// the true alleles out of range are excluded
+		vector<int> S1(n), S2(n), Q1(n), Q2(n);
+		for (int i=0; i < n; i++)
+		{
+			const int a1 = INTEGER(T1)[i], a2 = INTEGER(T2)[i];
+			S1[i] = ((a1 != NA_INTEGER) && (0 <= a1) && (a1 < m)) ? a1 : -1;
+			S2[i] = ((a2 != NA_INTEGER) && (0 <= a2) && (a2 < m)) ? a2 : -1;
+			const int b1 = INTEGER(P1)[i], b2 = INTEGER(P2)[i];
+			Q1[i] = ((b1 == NA_INTEGER) || ((0 <= b1) && (b1 <= m))) ? b1 : m;
+			Q2[i] = ((b2 == NA_INTEGER) || ((0 <= b2) && (b2 <= m))) ? b2 : m;
+		}
+
+		rv_ans = PROTECT(NEW_LIST(5));
+		SEXP out_Overall = PROTECT(NEW_NUMERIC(8));
+		SET_ELEMENT(rv_ans, 0, out_Overall);
+		SEXP out_Conf = PROTECT(allocMatrix(REALSXP, m+1, m));
+		SET_ELEMENT(rv_ans, 1, out_Conf);
+		SEXP out_Detail = PROTECT(allocMatrix(REALSXP, m, 6));
+		SET_ELEMENT(rv_ans, 2, out_Detail);
+		SEXP out_Num = PROTECT(NEW_NUMERIC(m));
+		SET_ELEMENT(rv_ans, 3, out_Num);
+		SEXP out_Acc = PROTECT(NEW_NUMERIC(n));
+		SET_ELEMENT(rv_ans, 4, out_Acc);
+
+		// no individual after filtering, NaN statistics
+		TCompareCount Cnt;
+		_CompareCount(n, m, (n > 0) ? &S1[0] : NULL, (n > 0) ? &S2[0] : NULL,
+			(n > 0) ? &Q1[0] : NULL, (n > 0) ? &Q2[0] : NULL,
+			Rf_isNull(prob) ? NULL : REAL(prob), threshold, Cnt, REAL(out_Acc));
+		_CompareStat(Cnt, threshold, REAL(out_Overall), REAL(out_Conf),
+			REAL(out_Detail));
+		for (int a=0; a < m; a++)
+			REAL(out_Num)[a] = Cnt.TrueNumAll[a];
+
+		UNPROTECT(6);
+	CORE_CATCH
+}
+
+
+/**
+ *  Evaluate the out-of-bag samples of each classifier, and sum up the
+ *    statistics of 'hlaCompareAllele()' over classifiers
+ *
+ *  \param model          the model index
+ *  \param GenoMat        the SNP genotypes of training samples
+ *  \param T1             the true allele 1 (0 .. n_allele-1), or NA
+ *  \param T2             the true allele 2
+ *  \param AlleleIdx      the positions (0 .. n_allele-1) of the model alleles
+ *  \param n_allele       the number of alleles in comparison
+ *  \param call_threshold the call threshold, NaN for no threshold
+ *  \param NumThread      the number of threads
+ *  \param ShowInfo       whether showing information
+ *  \return the sums of overall statistics, confusion matrices and details,
+ *          and the numbers of non-NaN details
+**/
+SEXP HIBAG_OutOfBag(SEXP model, SEXP GenoMat, SEXP T1, SEXP T2,
+	SEXP AlleleIdx, SEXP n_allele, SEXP call_threshold, SEXP NumThread,
+	SEXP ShowInfo)
+{
+	int midx = Rf_asInteger(model);
+	const int m = Rf_asInteger(n_allele);
+	const double threshold = Rf_asReal(call_threshold);
+
+	CORE_TRY
+		_Check_HIBAG_Model(midx);
+		CAttrBag_Model &M = *_HIBAG_MODELS_[midx];
+		const int n = M.nSamp();
+		const int n_cls = M.ClassifierList().size();
+		if (XLENGTH(GenoMat) != (R_xlen_t)M.nSNP() * n)
+			throw ErrHLA("Invalid length of SNP genotypes.");
+		if ((XLENGTH(T1) != n) || (XLENGTH(T2) != n))
+			throw ErrHLA("Invalid length of HLA types.");
+		if (XLENGTH(AlleleIdx) != M.nHLA())
+			throw ErrHLA("Invalid length of HLA alleles.");
+
+		// predict
+		CdMemUsage MemOut(MEM_OUTPUT);
+		MemOut.Set((size_t)n * n_cls * (2*sizeof(int) + sizeof(double)));
+		vector<int> H1((size_t)n * n_cls), H2((size_t)n * n_cls);
+		vector<double> Prob((size_t)n * n_cls);
+		bool show = _Init_Progress(M.Progress(), Rf_asLogical(ShowInfo)==TRUE);
+		if (n_cls > 0)
+		{
+			M.PredictOutOfBag(INTEGER(GenoMat), &H1[0], &H2[0], &Prob[0],
+				Rf_asInteger(NumThread), show);
+		}
+
+		// the true alleles
+		vector<int> S1(n), S2(n);
+		for (int i=0; i < n; i++)
+		{
+			const int a1 = INTEGER(T1)[i], a2 = INTEGER(T2)[i];
+			S1[i] = ((a1 != NA_INTEGER) && (0 <= a1) && (a1 < m)) ? a1 : -1;
+			S2[i] = ((a2 != NA_INTEGER) && (0 <= a2) && (a2 < m)) ? a2 : -1;
+		}
+		// the model alleles to the positions
+		const int *pIdx = INTEGER(AlleleIdx);
+		for (size_t k=0; k < H1.size(); k++)
+		{
+			if (H1[k] != NA_INTEGER)
+			{
+				const int a = pIdx[H1[k]];
+				H1[k] = ((a != NA_INTEGER) && (0 <= a) && (a < m)) ? a : m;
+			}
+			if (H2[k] != NA_INTEGER)
+			{
+				const int a = pIdx[H2[k]];
+				H2[k] = ((a != NA_INTEGER) && (0 <= a) && (a < m)) ? a : m;
+			}
+		}
+
+		// output
+		rv_ans = PROTECT(NEW_LIST(4));
+		SEXP out_Overall = PROTECT(NEW_NUMERIC(8));
+		SET_ELEMENT(rv_ans, 0, out_Overall);
+		SEXP out_Conf = PROTECT(allocMatrix(REALSXP, m+1, m));
+		SET_ELEMENT(rv_ans, 1, out_Conf);
+		SEXP out_Detail = PROTECT(allocMatrix(REALSXP, m, 6));
+		SET_ELEMENT(rv_ans, 2, out_Detail);
+		SEXP out_NDetail = PROTECT(allocMatrix(INTSXP, m, 6));
+		SET_ELEMENT(rv_ans, 3, out_NDetail);
+
+		double *pOverall = REAL(out_Overall);
+		double *pConf = REAL(out_Conf);
+		double *pDetail = REAL(out_Detail);
+		int *pNDetail = INTEGER(out_NDetail);
+		memset(pOverall, 0, sizeof(double)*8);
+		memset(pConf, 0, sizeof(double)*(m+1)*m);
+		memset(pDetail, 0, sizeof(double)*m*6);
+		memset(pNDetail, 0, sizeof(int)*m*6);
+
+		// sum up the statistics over classifiers, in the original order
+		vector<int> P1(n), P2(n);
+		vector<double> Overall(8), Conf((m+1)*m), Detail(m*6);
+		TCompareCount Cnt;
+		for (int c=0; c < n_cls; c++)
+		{
+			const size_t st = (size_t)c * n;
+			const vector<int> &B = M.ClassifierList()[c].BootstrapCount();
+			for (int i=0; i < n; i++)
+			{
+				// only the out-of-bag samples
+				P1[i] = (B[i] > 0) ? NA_INTEGER : H1[st + i];
+				P2[i] = (B[i] > 0) ? NA_INTEGER : H2[st + i];
+			}
+			_CompareCount(n, m, &S1[0], &S2[0], &P1[0], &P2[0],
+				R_finite(threshold) ? &Prob[st] : NULL, threshold, Cnt);
+			_CompareStat(Cnt, threshold, &Overall[0],
+				Conf.empty() ? NULL : &Conf[0],
+				Detail.empty() ? NULL : &Detail[0]);
+
+			for (int j=0; j < 8; j++) pOverall[j] += Overall[j];
+			for (int j=0; j < (m+1)*m; j++) pConf[j] += Conf[j];
+			for (int j=0; j < m*6; j++)
+			{
+				if (!ISNAN(Detail[j]))
+					{ pDetail[j] += Detail[j]; pNDetail[j] ++; }
+			}
+		}
+
+		UNPROTECT(5);
+	CORE_CATCH
+}
+
+
+/**
+ *  Composite linkage disequilibrium (r2) between HLA alleles and SNPs
+ *
+ *  \param GenoMat        the SNP genotypes, a n_snp-by-n_samp integer matrix
+ *  \param H1             the HLA allele 1 (0 .. n_allele-1), or NA
+ *  \param H2             the HLA allele 2
+ *  \param n_allele       the number of HLA alleles
+ *  \param r2_mat         whether returning the r2 matrix of SNPs and alleles
+ *  \param NumThread      the number of threads
+ *  \return the mean r2 of each SNP over alleles, and the r2 matrix or NULL
+**/
+SEXP HIBAG_GenoLD(SEXP GenoMat, SEXP H1, SEXP H2, SEXP n_allele,
+	SEXP r2_mat, SEXP NumThread)
+{
+	const int m = Rf_asInteger(n_allele);
+	const bool full = (Rf_asLogical(r2_mat) == TRUE);
+
+	CORE_TRY
+		const int n_snp = Rf_nrows(GenoMat);
+		const int n_samp = Rf_ncols(GenoMat);
+		if ((XLENGTH(H1) != n_samp) || (XLENGTH(H2) != n_samp))
+			throw ErrHLA("Invalid length of HLA types.");
+		if ((m == NA_INTEGER) || (m < 0))
+			throw ErrHLA("Invalid number of HLA alleles.");
+
+		CPackedSNPMatrix Geno;
+		Geno.SetNumThread(Rf_asInteger(NumThread));
+		Geno.Init(INTEGER(GenoMat), n_snp, n_samp);
+
+		rv_ans = PROTECT(NEW_LIST(2));
+		SEXP out_Mean = PROTECT(NEW_NUMERIC(n_snp));
+		SET_ELEMENT(rv_ans, 0, out_Mean);
+		double *pR2 = NULL;
+		if (full)
+		{
+			SEXP out_R2 = PROTECT(allocMatrix(REALSXP, n_snp, m));
+			SET_ELEMENT(rv_ans, 1, out_R2);
+			pR2 = REAL(out_R2);
+		}
+		Geno.LD_HLA(INTEGER(H1), INTEGER(H2), m, REAL(out_Mean), pR2);
+		UNPROTECT(full ? 3 : 2);
+	CORE_CATCH
+}
+
+
+/**
+ *  Summary statistics of SNP genotypes
+ *
+ *  \param GenoMat        the SNP genotypes, a n_snp-by-n_samp integer matrix
+ *  \param NumThread      the number of threads
+ *  \return the allele frequency and missing rate of each SNP, the missing
+ *          rate of each sample, and whether each SNP is monomorphic
+**/
+SEXP HIBAG_GenoSummary(SEXP GenoMat, SEXP NumThread)
+{
+	CORE_TRY
+		const int n_snp = Rf_nrows(GenoMat);
+		const int n_samp = Rf_ncols(GenoMat);
+
+		CPackedSNPMatrix Geno;
+		Geno.SetNumThread(Rf_asInteger(NumThread));
+		Geno.Init(INTEGER(GenoMat), n_snp, n_samp);
+
+		rv_ans = PROTECT(NEW_LIST(4));
+		SEXP out_AFreq = PROTECT(NEW_NUMERIC(n_snp));
+		SET_ELEMENT(rv_ans, 0, out_AFreq);
+		SEXP out_MissSNP = PROTECT(NEW_NUMERIC(n_snp));
+		SET_ELEMENT(rv_ans, 1, out_MissSNP);
+		SEXP out_MissSamp = PROTECT(NEW_NUMERIC(n_samp));
+		SET_ELEMENT(rv_ans, 2, out_MissSamp);
+		SEXP out_Mono = PROTECT(NEW_LOGICAL(n_snp));
+		SET_ELEMENT(rv_ans, 3, out_Mono);
+
+		Geno.Summary(REAL(out_AFreq), REAL(out_MissSNP), REAL(out_MissSamp),
+			LOGICAL(out_Mono));
+		UNPROTECT(5);
 	CORE_CATCH
 }
 
@@ -863,7 +1765,7 @@ SEXP HIBAG_ConvBED(SEXP bedfn, SEXP n_samp, SEXP n_snp, SEXP n_save_snp,
 		int I_SNP = 0;
 
 		// output
-		rv_ans = allocMatrix(INTSXP, NumSvSNP, NumSamp);
+		rv_ans = _AllocMatrix(INTSXP, NumSvSNP, NumSamp);
 
 		// for - loop
 		for (int i=0; i < nNum; i++)
@@ -893,7 +1795,7 @@ SEXP HIBAG_ConvBED(SEXP bedfn, SEXP n_samp, SEXP n_snp, SEXP n_save_snp,
 			if (mode == 0)
 			{
 				// the individual-major mode
-				int *pI = INTEGER(rv_ans) + i * NumSvSNP;
+				int *pI = INTEGER(rv_ans) + (size_t)i * NumSvSNP;
 				for (int j=0; j < NumSNP; j++)
 				{
 					if (pflag[j])
@@ -1055,25 +1957,33 @@ void R_init_HIBAG(DllInfo *info)
 
 	static R_CallMethodDef callMethods[] =
 	{
-		CALL(HIBAG_AlleleStrand, 8),
-		CALL(HIBAG_AlleleStrand2, 2),
+		CALL(HIBAG_AlleleStrand, 10),
+		CALL(HIBAG_AlleleStrand2, 3),
 		CALL(HIBAG_BEDFlag, 1),
+		CALL(HIBAG_GenoLD, 6),
+		CALL(HIBAG_GenoSummary, 2),
 		CALL(HIBAG_GetNumClassifiers, 1),
+		CALL(HIBAG_GetTrainingTrace, 1),
 		CALL(HIBAG_Classifier_GetHaplos, 2),
 		CALL(HIBAG_Close, 1),
+		CALL(HIBAG_CompareAllele, 7),
 		CALL(HIBAG_Confusion, 4),
 		CALL(HIBAG_ConvBED, 5),
 		CALL(HIBAG_ErrMsg, 0),
 		CALL(HIBAG_Kernel_Version, 0),
+		CALL(HIBAG_MemUsage, 1),
 		CALL(HIBAG_New, 3),
 		CALL(HIBAG_NewClassifierHaplo, 7),
-		CALL(HIBAG_NewClassifiers, 6),
-		CALL(HIBAG_Predict_Resp, 5),
-		CALL(HIBAG_Predict_Resp_Prob, 5),
+		CALL(HIBAG_NewClassifiers, 12),
+		CALL(HIBAG_OutOfBag, 9),
+		CALL(HIBAG_Predict_Resp, 8),
+		CALL(HIBAG_Predict_Resp_Prob, 8),
 		CALL(HIBAG_Training, 6),
 		CALL(HIBAG_SortAlleleStr, 1),
 		CALL(HIBAG_SeqMerge, 1),
 		CALL(HIBAG_SeqRmDot, 2),
+		CALL(HIBAG_SetMemBudget, 1),
+		CALL(HIBAG_SetProgress, 3),
 		{ NULL, NULL, 0 }
 	};
 
@@ -1085,6 +1995,17 @@ void R_init_HIBAG(DllInfo *info)
 /// Finalize the package
 void R_unload_HIBAG(DllInfo *info)
 {
+	if (_Progress_LogFile)
+	{
+		delete _Progress_LogFile;
+		_Progress_LogFile = NULL;
+	}
+	if (!Rf_isNull(_Progress_Callback.Func))
+	{
+		R_ReleaseObject(_Progress_Callback.Func);
+		_Progress_Callback.Func = R_NilValue;
+	}
+
 	try
 	{
 		for (int i=0; i < MODEL_NUM_LIMIT; i++)
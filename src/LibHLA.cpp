@@ -39,6 +39,12 @@
 #   include <time.h>
 #endif
 
+#include <sys/time.h>
+
+#ifdef _OPENMP
+#   include <omp.h>
+#endif
+
 
 using namespace std;
 using namespace HLA_LIB;
@@ -71,6 +77,13 @@ static const double FRACTION_HAPLO = 1.0/10;
 static const double STOP_RELTOL_LOGLIK_ADDSNP = 0.001;
 /// the reltol for erasing the SNP marker is prune = TRUE
 static const double PRUNE_RELTOL_LOGLIK = 0.1;
+/// the number of EM iterations in the first round of successive halving
+static const int HALVING_EM_ITER = 4;
+/// the minimum number of out-of-bag groups in a subsample of successive halving
+static const int HALVING_MIN_OOB_GROUP = 32;
+/// the number of classifiers, over which the ensemble out-of-bag accuracy
+//    should be stable to stop training
+static const int ENSEMBLE_STOP_WINDOW = 10;
 
 
 /// Random number: return an integer from 0 to n-1 with equal probability
@@ -82,6 +95,18 @@ static inline int RandomNum(int n)
 	return v;
 }
 
+/// the number of bits set in a 64-bit integer
+static inline int POPCNT_U64(uint64_t x)
+{
+#if defined(HIBAG_HARDWARE_POPCNT) && defined(HIBAG_REG_BIT64)
+	return _mm_popcnt_u64(x);
+#else
+	x -= ((x >> 1) & 0x5555555555555555LLU);
+	x = (x & 0x3333333333333333LLU) + ((x >> 2) & 0x3333333333333333LLU);
+	return (((x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FLLU) * 0x0101010101010101LLU) >> 56;
+#endif
+}
+
 
 
 // ========================================================================= //
@@ -140,10 +165,58 @@ static inline void _inc_timing()
 
 // CdProgression
 
-static const clock_t TimeInterval = 15*CLOCKS_PER_SEC;
+static const double TimeInterval = 15;
+
+/// the string of time period
+static string _time_str(double sec)
+{
+	char buf[64];
+	if (!R_finite(sec) || (sec < 0))
+		return string("NA");
+	if (sec < 60)
+		snprintf(buf, sizeof(buf), "%.0fs", sec);
+	else if (sec < 3600)
+		snprintf(buf, sizeof(buf), "%dm %02ds", int(sec/60), int(sec) % 60);
+	else
+		snprintf(buf, sizeof(buf), "%dh %02dm", int(sec/3600), (int(sec)/60) % 60);
+	return string(buf);
+}
+
+void CdProgressConsole::Report(const CdProgression &Prog)
+{
+	time_t tm; time(&tm);
+	string s(ctime(&tm));
+	s.erase(s.size()-1, 1);
+	Rprintf("%s\t%s\t%d%%\t%s\n", Prog.Info.c_str(), s.c_str(),
+		Prog.Percent()*CdProgression::StepPercent, Prog.RateETAStr().c_str());
+}
+
+CdProgressLogFile::CdProgressLogFile(const char *fn)
+{
+	FileName = fn;
+}
+
+void CdProgressLogFile::Report(const CdProgression &Prog)
+{
+	FILE *f = fopen(FileName.c_str(), "a");
+	if (f)
+	{
+		time_t tm; time(&tm);
+		string s(ctime(&tm));
+		s.erase(s.size()-1, 1);
+		fprintf(f, "%s\t%s\t%ld\t%ld\t%d%%\t%.1f\t%.1f\t%g\n",
+			Prog.Info.c_str(), s.c_str(), Prog.Current(), Prog.Total(),
+			Prog.Percent()*CdProgression::StepPercent,
+			Prog.Elapsed(), Prog.ETA(), Prog.Rate());
+		fclose(f);
+	}
+}
 
 CdProgression::CdProgression()
 {
+	Unit = "samples";
+	RatePerHour = false;
+	Interval = TimeInterval;
 	Init(0, false);
 }
 
@@ -152,22 +225,35 @@ void CdProgression::Init(long TotalCnt, bool ShowInit)
 	if (TotalCnt < 0) TotalCnt = 0;
 	fTotal = TotalCnt;
 	fCurrent = fPercent = 0;
-	OldTime = clock();
+	fStartTime = fOldTime = WallClock();
 	if (ShowInit) ShowProgress();
 }
 
 bool CdProgression::Forward(long step, bool Show)
 {
-	fCurrent += step;
-	int p = int(double(TotalPercent)*fCurrent / fTotal);
+	long cur;
+#ifdef _OPENMP
+	#pragma omp atomic capture
+#endif
+	cur = fCurrent += step;
+
+#ifdef _OPENMP
+	// the sinks may call R, so there is no report in a parallel region;
+	//   the calling thread reports by 'Forward(0, Show)' after the region
+	if (omp_in_parallel()) return false;
+#endif
+
+	if (fTotal <= 0) return false;
+	int p = int(double(TotalPercent)*cur / fTotal);
 	if ((p != fPercent) || (p == TotalPercent))
 	{
-		clock_t Now = clock();
-		if (((Now - OldTime) >= TimeInterval) || (p == TotalPercent))
+		double Now = WallClock();
+		if (((Now - fOldTime) >= Interval) ||
+			((p == TotalPercent) && (fPercent != TotalPercent)))
 		{
 			fPercent = p;
 			if (Show) ShowProgress();
-			OldTime = Now;
+			fOldTime = Now;
 			return true;
 		}
 	}
@@ -176,16 +262,448 @@ bool CdProgression::Forward(long step, bool Show)
 
 void CdProgression::ShowProgress()
 {
-	time_t tm; time(&tm);
-	string s(ctime(&tm));
-	s.erase(s.size()-1, 1);
-	Rprintf("%s\t%s\t%d%%\n", Info.c_str(), s.c_str(),
-		int(fPercent*StepPercent));
+	vector<CdProgressSink*>::iterator it;
+	for (it = fSinks.begin(); it != fSinks.end(); it++)
+		(*it)->Report(*this);
+}
+
+void CdProgression::ClearSink()
+{
+	fSinks.clear();
+}
+
+void CdProgression::AddSink(CdProgressSink *sink)
+{
+	if (sink) fSinks.push_back(sink);
+}
+
+double CdProgression::Elapsed() const
+{
+	return WallClock() - fStartTime;
+}
+
+double CdProgression::ETA() const
+{
+	if ((fCurrent <= 0) || (fTotal <= 0)) return R_NaN;
+	return Elapsed() * (fTotal - fCurrent) / fCurrent;
+}
+
+double CdProgression::Rate() const
+{
+	double tm = Elapsed();
+	if (tm <= 0) return R_NaN;
+	return fCurrent / tm * (RatePerHour ? 3600 : 1);
+}
+
+string CdProgression::RateETAStr() const
+{
+	char buf[256];
+	if (fCurrent >= fTotal)
+	{
+		snprintf(buf, sizeof(buf), "(%.4g %s/%s, used: %s)", Rate(),
+			Unit.c_str(), RatePerHour ? "hour" : "sec",
+			_time_str(Elapsed()).c_str());
+	} else {
+		snprintf(buf, sizeof(buf), "(%.4g %s/%s, ETA: %s)", Rate(),
+			Unit.c_str(), RatePerHour ? "hour" : "sec",
+			_time_str(ETA()).c_str());
+	}
+	return string(buf);
+}
+
+
+/// wall-clock time in seconds
+double HLA_LIB::WallClock()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+
+
+// ========================================================================= //
+// ========================================================================= //
+
+// -------------------------------------------------------------------------
+// Memory accounting
+
+CdMemAccount HLA_LIB::MemAccount;
+
+static const double MEGABYTE = 1024.0 * 1024.0;
+
+CdMemAccount::CdMemAccount()
+{
+	Budget = 0;
+	memset(fCurrent, 0, sizeof(fCurrent));
+	memset(fPeak, 0, sizeof(fPeak));
+	fTotal = fTotalPeak = 0;
+}
+
+void CdMemAccount::Update(TMemSubsystem Sub, size_t OldBytes,
+	size_t NewBytes)
+{
+	if (OldBytes == NewBytes) return;
+
+	// the budget check and the update are atomic, and the exception is
+	//   thrown outside the critical section
+	bool over = false;
+	size_t total = 0;
+#ifdef _OPENMP
+	#pragma omp critical(HIBAG_MemAccount)
+#endif
+	{
+		total = fTotal;
+		if ((NewBytes > OldBytes) && (Budget > 0) &&
+			(fTotal - OldBytes + NewBytes > Budget))
+		{
+			over = true;
+		} else {
+			fCurrent[Sub] = fCurrent[Sub] - OldBytes + NewBytes;
+			fTotal = fTotal - OldBytes + NewBytes;
+			if (fCurrent[Sub] > fPeak[Sub]) fPeak[Sub] = fCurrent[Sub];
+			if (fTotal > fTotalPeak) fTotalPeak = fTotal;
+		}
+	}
+	if (over)
+		_ThrowBudget(Sub, NewBytes - OldBytes, total);
+}
+
+void CdMemAccount::Check(TMemSubsystem Sub, size_t Bytes) const
+{
+	bool over = false;
+	size_t total = 0;
+#ifdef _OPENMP
+	#pragma omp critical(HIBAG_MemAccount)
+#endif
+	{
+		total = fTotal;
+		over = (Budget > 0) && (fTotal + Bytes > Budget);
+	}
+	if (over)
+		_ThrowBudget(Sub, Bytes, total);
+}
+
+void CdMemAccount::_ThrowBudget(TMemSubsystem Sub, size_t Bytes,
+	size_t Total) const
+{
+	throw ErrHLA("Out of the memory budget (%.4g MB): %.4g MB more for "
+		"%s with %.4g MB in use.", Budget/MEGABYTE, Bytes/MEGABYTE,
+		Name(Sub), Total/MEGABYTE);
+}
+
+void CdMemAccount::ResetPeak()
+{
+	for (int i=0; i < MEM_NUM_SUBSYSTEM; i++)
+		fPeak[i] = fCurrent[i];
+	fTotalPeak = fTotal;
+}
+
+const char *CdMemAccount::Name(TMemSubsystem Sub)
+{
+	static const char *Names[MEM_NUM_SUBSYSTEM] = {
+		"genotype", "haplotype", "EM pair", "scratch", "output"
+	};
+	return Names[Sub];
+}
+
+
+CdMemUsage::CdMemUsage(TMemSubsystem Sub)
+{
+	fSub = Sub; fBytes = 0;
+}
+
+CdMemUsage::CdMemUsage(const CdMemUsage &src)
+{
+	fSub = src.fSub; fBytes = 0;
+	Set(src.fBytes);
+}
+
+CdMemUsage::~CdMemUsage()
+{
+	Set(0);
+}
+
+CdMemUsage &CdMemUsage::operator= (const CdMemUsage &src)
+{
+	if (this != &src)
+	{
+		Set(0);
+		fSub = src.fSub;
+		Set(src.fBytes);
+	}
+	return *this;
+}
+
+#if (__cplusplus >= 201103L)
+CdMemUsage::CdMemUsage(CdMemUsage &&src) noexcept
+{
+	fSub = src.fSub; fBytes = src.fBytes;
+	src.fBytes = 0;
+}
+
+CdMemUsage &CdMemUsage::operator= (CdMemUsage &&src) noexcept
+{
+	if (this != &src)
+	{
+		// releasing never exceeds the budget
+		Set(0);
+		fSub = src.fSub; fBytes = src.fBytes;
+		src.fBytes = 0;
+	}
+	return *this;
+}
+#endif
+
+void CdMemUsage::Set(size_t Bytes)
+{
+	MemAccount.Update(fSub, fBytes, Bytes);
+	fBytes = Bytes;
+}
+
+
+
+
+// ========================================================================= //
+// ========================================================================= //
+
+/// the number of SNPs packed together in a block
+static const int PACKED_SNP_BLOCK = 256;
+
+CPackedSNPMatrix::CPackedSNPMatrix(): _MemBits(MEM_GENOTYPE)
+{
+	_nSNP = _nSamp = 0;
+	_nWord = 0;
+	_nThread = 1;
+}
+
+void CPackedSNPMatrix::SetNumThread(int n)
+{
+	_nThread = (n >= 1) ? n : 1;
+}
+
+void CPackedSNPMatrix::Init(const int *geno, int n_snp, int n_samp)
+{
+	if ((n_snp < 0) || (n_samp < 0))
+		throw ErrHLA("Invalid dimension of SNP genotypes.");
+
+	const size_t nWord = ((size_t)n_samp + 63) / 64;
+	const size_t n = 3 * nWord * n_snp;
+	_MemBits.Set(n * sizeof(uint64_t));
+	_Bits.assign(n, 0);
+	_nSNP = n_snp; _nSamp = n_samp;
+	_nWord = nWord;
+	if (n <= 0) return;
+
+	// each thread packs 64 samples of a block of SNPs at a time, reading
+	//   the genotypes row by row
+	const int nW = _nWord;
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static) num_threads(_nThread)
+#endif
+	for (int w=0; w < nW; w++)
+	{
+		const int st = w * 64;
+		const int ed = min(st + 64, n_samp);
+		uint64_t V[PACKED_SNP_BLOCK], A[PACKED_SNP_BLOCK], B[PACKED_SNP_BLOCK];
+		for (int j0=0; j0 < n_snp; j0 += PACKED_SNP_BLOCK)
+		{
+			const int nj = min(PACKED_SNP_BLOCK, n_snp - j0);
+			memset(V, 0, sizeof(uint64_t)*nj);
+			memset(A, 0, sizeof(uint64_t)*nj);
+			memset(B, 0, sizeof(uint64_t)*nj);
+			for (int i=st; i < ed; i++)
+			{
+				const int *g = geno + (size_t)i*n_snp + j0;
+				const uint64_t bit = uint64_t(1) << (i - st);
+				for (int j=0; j < nj; j++)
+				{
+					// NA_INTEGER and other negative values are out of range
+					const unsigned u = (unsigned)g[j];
+					const uint64_t m = (u <= 2) ? bit : 0;
+					V[j] |= m;
+					A[j] |= (u >= 1) ? m : 0;
+					B[j] |= (u == 2) ? m : 0;
+				}
+			}
+			for (int j=0; j < nj; j++)
+			{
+				uint64_t *p = &_Bits[3*_nWord*(j0 + j) + w];
+				p[0] = V[j]; p[_nWord] = A[j]; p[2*_nWord] = B[j];
+			}
+		}
+	}
+}
+
+void CPackedSNPMatrix::LD_HLA(const int H1[], const int H2[], int n_allele,
+	double OutMeanR2[], double OutR2[]) const
+{
+	if (n_allele < 0)
+		throw ErrHLA("Invalid number of HLA alleles.");
+
+	if (_nWord <= 0)
+	{
+		for (int j=0; j < _nSNP; j++) OutMeanR2[j] = R_NaN;
+		if (OutR2)
+		{
+			for (size_t k=0; k < (size_t)_nSNP*n_allele; k++)
+				OutR2[k] = R_NaN;
+		}
+		return;
+	}
+
+	// the bit planes of HLA alleles: (d >= 1) and (d == 2) for the dosage d,
+	//   followed by the samples with both alleles available
+	const size_t nW = _nWord;
+	const size_t nH = (2*(size_t)n_allele + 1) * nW + 1;
+	CdMemUsage MemHLA(MEM_SCRATCH);
+	MemHLA.Set(nH * sizeof(uint64_t));
+	vector<uint64_t> HBits(nH, 0);
+	uint64_t *HValid = &HBits[2*(size_t)n_allele*nW];
+	for (int i=0; i < _nSamp; i++)
+	{
+		const int a1 = H1[i], a2 = H2[i];
+		if ((a1 < 0) || (a1 >= n_allele) || (a2 < 0) || (a2 >= n_allele))
+			continue;
+		const size_t w = i >> 6;
+		const uint64_t bit = uint64_t(1) << (i & 0x3F);
+		HValid[w] |= bit;
+		HBits[2*a1*nW + w] |= bit;
+		if (a1 == a2)
+			HBits[(2*a1 + 1)*nW + w] |= bit;
+		else
+			HBits[2*a2*nW + w] |= bit;
+	}
+
+	// the range of words with the allele carriers, rare alleles only need
+	//   a few words
+	vector<int> WStart(n_allele), WEnd(n_allele);
+	for (int a=0; a < n_allele; a++)
+	{
+		const uint64_t *p = &HBits[2*a*nW];
+		int st = 0, ed = nW;
+		while ((st < ed) && (p[st] == 0)) st ++;
+		while ((ed > st) && (p[ed-1] == 0)) ed --;
+		WStart[a] = st; WEnd[a] = ed;
+	}
+
+	// for each SNP
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(dynamic, 64) num_threads(_nThread)
+#endif
+	for (int j=0; j < _nSNP; j++)
+	{
+		const uint64_t *pV = Valid(j), *pG1 = G1(j), *pG2 = G2(j);
+
+		// the SNP over the samples with HLA types, g = G1 + G2
+		size_t n = 0, g1 = 0, g2 = 0;
+		for (size_t w=0; w < nW; w++)
+		{
+			const uint64_t v = pV[w] & HValid[w];
+			n += POPCNT_U64(v);
+			g1 += POPCNT_U64(pG1[w] & v);
+			g2 += POPCNT_U64(pG2[w] & v);
+		}
+		const double N = n;
+		const double SumG = g1 + g2, SumG2 = g1 + 3*g2;
+		const double VarG = N*SumG2 - SumG*SumG;
+
+		// correlation with each allele dosage over pairwise complete samples,
+		//   G1 and G2 are zero for missing genotypes, and so are D1 and D2 for
+		//   missing HLA types
+		double sum = 0;
+		int cnt = 0;
+		for (int a=0; a < n_allele; a++)
+		{
+			const uint64_t *pD1 = &HBits[2*a*nW], *pD2 = pD1 + nW;
+			size_t d1 = 0, d2 = 0, x = 0;
+			for (int w=WStart[a]; w < WEnd[a]; w++)
+			{
+				const uint64_t D1 = pD1[w], D2 = pD2[w];
+				const uint64_t A = pG1[w], B = pG2[w];
+				d1 += POPCNT_U64(D1 & pV[w]);
+				d2 += POPCNT_U64(D2 & pV[w]);
+				x += POPCNT_U64(A & D1) + POPCNT_U64(A & D2) +
+					POPCNT_U64(B & D1) + POPCNT_U64(B & D2);
+			}
+			const double SumD = d1 + d2, SumD2 = d1 + 3*d2;
+			const double VarD = N*SumD2 - SumD*SumD;
+			double r2 = R_NaN;
+			if ((VarG > 0) && (VarD > 0))
+			{
+				const double r = (N*x - SumG*SumD) / sqrt(VarG * VarD);
+				r2 = r * r;
+				sum += r2; cnt ++;
+			}
+			if (OutR2)
+				OutR2[j + (size_t)a*_nSNP] = r2;
+		}
+		OutMeanR2[j] = (cnt > 0) ? (sum / cnt) : R_NaN;
+	}
 }
 
+void CPackedSNPMatrix::Summary(double OutAFreq[], double OutMissSNP[],
+	double OutMissSamp[], int OutMono[]) const
+{
+	const size_t nW = _nWord;
+
+	// for each SNP, g = G1 + G2
+#ifdef _OPENMP
+	#pragma omp parallel for schedule(static) num_threads(_nThread)
+#endif
+	for (int j=0; j < _nSNP; j++)
+	{
+		size_t n = 0, g1 = 0, g2 = 0;
+		if (nW > 0)
+		{
+			const uint64_t *pV = Valid(j), *pG1 = G1(j), *pG2 = G2(j);
+			for (size_t w=0; w < nW; w++)
+			{
+				n += POPCNT_U64(pV[w]);
+				g1 += POPCNT_U64(pG1[w]);
+				g2 += POPCNT_U64(pG2[w]);
+			}
+		}
+		if (OutAFreq)
+			OutAFreq[j] = (n > 0) ? (double(g1 + g2) / n * 0.5) : R_NaN;
+		if (OutMissSNP)
+		{
+			OutMissSNP[j] = (_nSamp > 0) ?
+				(double(_nSamp - n) / _nSamp) : R_NaN;
+		}
+		if (OutMono)
+			OutMono[j] = (n <= 0) || (g1 <= 0) || (g2 >= n);
+	}
 
-/// The progression information
-CdProgression HLA_LIB::Progress;
+	// for each sample, counting the missing bits of 64 samples at a time
+	if (OutMissSamp)
+	{
+		const int nWord = nW;
+	#ifdef _OPENMP
+		#pragma omp parallel for schedule(static) num_threads(_nThread)
+	#endif
+		for (int w=0; w < nWord; w++)
+		{
+			const int st = w * 64;
+			const int nb = min(64, _nSamp - st);
+			const uint64_t mask = (nb < 64) ?
+				((uint64_t(1) << nb) - 1) : ~uint64_t(0);
+			int Cnt[64];
+			memset(Cnt, 0, sizeof(Cnt));
+			for (int j=0; j < _nSNP; j++)
+			{
+				uint64_t m = ~Valid(j)[w] & mask;
+				for (; m; m &= m - 1)
+					Cnt[POPCNT_U64((m & (~m + 1)) - 1)] ++;
+			}
+			for (int i=0; i < nb; i++)
+			{
+				OutMissSamp[st + i] = (_nSNP > 0) ?
+					(double(Cnt[i]) / _nSNP) : R_NaN;
+			}
+		}
+	}
+}
 
 
 
@@ -274,125 +792,143 @@ CHaplotypeList::CHaplotypeList()
 	Num_SNP = 0;
 }
 
-void CHaplotypeList::DoubleHaplos(CHaplotypeList &OutHaplos) const
+void CHaplotypeList::ScaleFrequency(const double scale)
 {
-	HIBAG_CHECKING(Num_SNP >= HIBAG_MAXNUM_SNP_IN_CLASSIFIER,
-		"CHaplotypeList::DoubleHaplos, there are too many SNP markers.");
-
-	OutHaplos.Num_SNP = Num_SNP + 1;
-	OutHaplos.List.resize(List.size());
-
-	const size_t i_n = List.size();
-	for (size_t i=0; i < i_n; i++)
+	vector< vector<THaplotype> >::iterator it;
+	for (it = List.begin(); it != List.end(); it++)
 	{
-		const vector<THaplotype> &src = List[i];
-		vector<THaplotype> &dst = OutHaplos.List[i];
-
-		dst.resize(src.size()*2);
-		const size_t j_n = src.size();
-		for (size_t j=0; j < j_n; j++)
+		vector<THaplotype>::iterator p;
+		for (p = it->begin(); p != it->end(); p++)
 		{
-			dst[2*j+0] = src[j];
-			dst[2*j+0]._SetAllele(Num_SNP, 0);
-			dst[2*j+1] = src[j];
-			dst[2*j+1]._SetAllele(Num_SNP, 1);
+			p->Frequency *= scale;
 		}
 	}
 }
 
-void CHaplotypeList::DoubleHaplosInitFreq(CHaplotypeList &OutHaplos,
-	const double AFreq) const
+size_t CHaplotypeList::TotalNumOfHaplo() const
+{
+	vector< vector<THaplotype> >::const_iterator it;
+	size_t Cnt = 0;
+	for (it = List.begin(); it != List.end(); it++)
+		Cnt += it->size();
+	return Cnt;
+}
+
+void CHaplotypeList::Swap(CHaplotypeList &Other)
+{
+	List.swap(Other.List);
+	std::swap(Num_SNP, Other.Num_SNP);
+}
+
+size_t CHaplotypeList::MemBytes() const
+{
+	vector< vector<THaplotype> >::const_iterator it;
+	size_t Cnt = List.capacity() * sizeof(vector<THaplotype>);
+	for (it = List.begin(); it != List.end(); it++)
+		Cnt += it->capacity() * sizeof(THaplotype);
+	return Cnt;
+}
+
+
+
+// -------------------------------------------------------------------------
+// The class of implicitly doubled haplotype list
+
+CDoubleHaploList::CDoubleHaploList()
+{
+	Parent = NULL;
+}
+
+void CDoubleHaploList::Init(const CHaplotypeList &Parent)
 {
-	static const char *msg =
-		"CHaplotypeList::DoubleHaplosInitFreq, the total number of haplotypes is not correct.";
-	HIBAG_CHECKING(List.size() != OutHaplos.List.size(), msg);
+	HIBAG_CHECKING(Parent.Num_SNP >= HIBAG_MAXNUM_SNP_IN_CLASSIFIER,
+		"CDoubleHaploList::Init, there are too many SNP markers.");
+
+	this->Parent = &Parent;
+	Start.resize(Parent.nHLA() + 1);
+	int n = 0;
+	for (size_t i=0; i < Parent.nHLA(); i++)
+	{
+		Start[i] = n;
+		n += Parent.List[i].size();
+	}
+	Start[Parent.nHLA()] = n;
+	Frequency.resize(2*n);
+	OldFreq.resize(2*n);
+}
 
+void CDoubleHaploList::InitFreq(const double AFreq)
+{
 	const double p0 = 1-AFreq, p1 = AFreq;
-	const size_t i_n = List.size();
+	double *p = &Frequency[0];
+	const size_t i_n = Parent->nHLA();
 	for (size_t i=0; i < i_n; i++)
 	{
-		const vector<THaplotype> &src = List[i];
-		vector<THaplotype> &dst = OutHaplos.List[i];
-		HIBAG_CHECKING(dst.size() != src.size()*2, msg);
-
+		const vector<THaplotype> &src = Parent->List[i];
 		const size_t j_n = src.size();
-		for (size_t j=0; j < j_n; j++)
+		for (size_t j=0; j < j_n; j++, p += 2)
 		{
-			dst[2*j+0].Frequency = src[j].Frequency*p0 + EM_INIT_VAL_FRAC;
-			dst[2*j+1].Frequency = src[j].Frequency*p1 + EM_INIT_VAL_FRAC;
+			p[0] = src[j].Frequency*p0 + EM_INIT_VAL_FRAC;
+			p[1] = src[j].Frequency*p1 + EM_INIT_VAL_FRAC;
 		}
 	}
 }
 
-void CHaplotypeList::MergeDoubleHaplos(const double RareProb,
+void CDoubleHaploList::SaveClearFrequency()
+{
+	OldFreq.swap(Frequency);
+	std::fill(Frequency.begin(), Frequency.end(), 0.0);
+}
+
+void CDoubleHaploList::ScaleFrequency(const double scale)
+{
+	vector<double>::iterator it;
+	for (it = Frequency.begin(); it != Frequency.end(); it++)
+		*it *= scale;
+}
+
+void CDoubleHaploList::EraseDoubleHaplos(const double RareProb,
 	CHaplotypeList &OutHaplos) const
 {
-	OutHaplos.Num_SNP = Num_SNP;
-	OutHaplos.List.resize(List.size());
+	const size_t Num_SNP = Parent->Num_SNP;
+	OutHaplos.Num_SNP = Num_SNP + 1;
+	OutHaplos.List.resize(Parent->nHLA());
+	double sum = 0;
 
-	const size_t i_n = List.size();
+	const double *pF = &Frequency[0], *pOld = &OldFreq[0];
+	const size_t i_n = Parent->nHLA();
 	for (size_t i=0; i < i_n; i++)
 	{
-		const vector<THaplotype> &src = List[i];
+		const vector<THaplotype> &src = Parent->List[i];
 		vector<THaplotype> &dst = OutHaplos.List[i];
 		dst.clear();
-		dst.reserve(src.size());
+		dst.reserve(2*src.size());
 
 		const size_t j_n = src.size();
-		for (size_t j=0; j < j_n; j += 2)
+		for (size_t j=0; j < j_n; j++, pF += 2, pOld += 2)
 		{
-			const THaplotype &p0 = src[j+0];
-			const THaplotype &p1 = src[j+1];
+			const double f0 = pF[0], f1 = pF[1];
+			double sumfreq = f0 + f1;
 
-			if ((p0.Frequency < RareProb) || (p1.Frequency < RareProb))
+			if ((f0 < RareProb) || (f1 < RareProb))
 			{
-				if (p0.Frequency >= p1.Frequency)
-					dst.push_back(p0);
-				else
-					dst.push_back(p1);
-				dst.back().Frequency = p0.Frequency + p1.Frequency;
+				if (sumfreq >= MIN_RARE_FREQ)
+				{
+					const int a = (f0 >= f1) ? 0 : 1;
+					dst.push_back(src[j]);
+					dst.back()._SetAllele(Num_SNP, a);
+					dst.back().OldFreq = pOld[a];
+					dst.back().Frequency = sumfreq;
+					sum += sumfreq;
+				}
 			} else {
-				dst.push_back(p0); dst.push_back(p1);
-			}
-		}
-	}
-}
-
-void CHaplotypeList::EraseDoubleHaplos(const double RareProb,
-	CHaplotypeList &OutHaplos) const
-{
-	OutHaplos.Num_SNP = Num_SNP;
-	OutHaplos.List.resize(List.size());
-	double sum = 0;
-
-	const size_t i_n = List.size();
-	for (size_t i=0; i < i_n; i++)
-	{
-		const vector<THaplotype> &src = List[i];
-		vector<THaplotype> &dst = OutHaplos.List[i];
-		dst.clear();
-		dst.reserve(src.size());
-		
-		const size_t j_n = src.size();
-		for (size_t j=0; j < j_n; j += 2)
-		{
-			const THaplotype &p0 = src[j+0];
-			const THaplotype &p1 = src[j+1];
-			double sumfreq = p0.Frequency + p1.Frequency;
-
-			if ((p0.Frequency < RareProb) || (p1.Frequency < RareProb))
-			{
-				if (sumfreq >= MIN_RARE_FREQ)
+				for (int a=0; a < 2; a++)
 				{
-					if (p0.Frequency >= p1.Frequency)
-						dst.push_back(p0);
-					else
-						dst.push_back(p1);
-					dst.back().Frequency = sumfreq;
-					sum += sumfreq;
+					dst.push_back(src[j]);
+					dst.back()._SetAllele(Num_SNP, a);
+					dst.back().OldFreq = pOld[a];
+					dst.back().Frequency = pF[a];
 				}
-			} else {
-				dst.push_back(p0); dst.push_back(p1);
 				sum += sumfreq;
 			}
 		}
@@ -401,40 +937,10 @@ void CHaplotypeList::EraseDoubleHaplos(const double RareProb,
 	OutHaplos.ScaleFrequency(1/sum);
 }
 
-void CHaplotypeList::SaveClearFrequency()
-{
-	vector< vector<THaplotype> >::iterator it;
-	for (it = List.begin(); it != List.end(); it++)
-	{
-		vector<THaplotype>::iterator p;
-		for (p = it->begin(); p != it->end(); p++)
-		{
-			p->OldFreq = p->Frequency;
-			p->Frequency = 0;
-		}
-	}
-}
-
-void CHaplotypeList::ScaleFrequency(const double scale)
-{
-	vector< vector<THaplotype> >::iterator it;
-	for (it = List.begin(); it != List.end(); it++)
-	{
-		vector<THaplotype>::iterator p;
-		for (p = it->begin(); p != it->end(); p++)
-		{
-			p->Frequency *= scale;
-		}
-	}
-}
-
-size_t CHaplotypeList::TotalNumOfHaplo() const
+size_t CDoubleHaploList::MemBytes() const
 {
-	vector< vector<THaplotype> >::const_iterator it;
-	size_t Cnt = 0;
-	for (it = List.begin(); it != List.end(); it++)
-		Cnt += it->size();
-	return Cnt;
+	return Start.capacity() * sizeof(int) +
+		(Frequency.capacity() + OldFreq.capacity()) * sizeof(double);
 }
 
 
@@ -854,12 +1360,12 @@ CSNPGenoMatrix::CSNPGenoMatrix()
 
 const int CSNPGenoMatrix::Get(const int IdxSamp, const int IdxSNP) const
 {
-	return pGeno[IdxSamp*Num_Total_SNP + IdxSNP];
+	return pGeno[(size_t)IdxSamp*Num_Total_SNP + IdxSNP];
 }
 
 int *CSNPGenoMatrix::Get(const int IdxSamp)
 {
-	return pGeno + IdxSamp * Num_Total_SNP;
+	return pGeno + (size_t)IdxSamp * Num_Total_SNP;
 }
 
 
@@ -889,6 +1395,17 @@ void CGenotypeList::AddSNP(int IdxSNP, const CSNPGenoMatrix &SNPMat)
 	Num_SNP ++;
 }
 
+void CGenotypeList::AddSNP(const UINT8 Geno[])
+{
+	HIBAG_CHECKING(Num_SNP >= HIBAG_MAXNUM_SNP_IN_CLASSIFIER,
+		"CGenotypeList::AddSNP, there are too many SNP markers.");
+
+	vector<TGenotype>::iterator it;
+	for (it = List.begin(); it != List.end(); it++)
+		it->_SetSNP(Num_SNP, *Geno++);
+	Num_SNP ++;
+}
+
 void CGenotypeList::ReduceSNP()
 {
 	HIBAG_CHECKING(Num_SNP <= 0,
@@ -926,64 +1443,82 @@ CSamplingWithoutReplace::CSamplingWithoutReplace()
 	_m_try = 0;
 }
 
-CBaseSampling *CSamplingWithoutReplace::Init(int m_total)
+CSamplingWithoutReplace *CSamplingWithoutReplace::Init(int m_total)
 {
 	_m_try = 0;
 	_IdxArray.resize(m_total);
-	for (int i=0; i < m_total; i++)
-		_IdxArray[i] = i;
+	if (_Weight.empty())
+	{
+		for (int i=0; i < m_total; i++)
+			_IdxArray[i] = i;
+	} else {
+		// the SNPs with ZERO weights are never sampled
+		int n = 0;
+		for (int i=0; i < m_total; i++)
+			if (_Weight[i] > 0) _IdxArray[n++] = i;
+		_IdxArray.resize(n);
+	}
 	return this;
 }
 
-int CSamplingWithoutReplace::TotalNum() const
+void CSamplingWithoutReplace::SetWeight(const double weight[], int n)
 {
-	return _IdxArray.size();
+	if (weight)
+		_Weight.assign(weight, weight + n);
+	else
+		_Weight.clear();
 }
 
 void CSamplingWithoutReplace::RandomSelect(int m_try)
 {
 	const int n_tmp = _IdxArray.size();
 	if (m_try > n_tmp) m_try = n_tmp;
-	if (m_try < n_tmp)
+	if ((m_try < n_tmp) && _Weight.empty())
 	{
 		for (int i=0; i < m_try; i++)
 		{
 			int I = RandomNum(n_tmp - i);
 			std::swap(_IdxArray[I], _IdxArray[n_tmp-i-1]);
 		}
+	} else if (m_try < n_tmp)
+	{
+		// weighted sampling without replacement (Efraimidis & Spirakis 2006):
+		//   the SNPs with the 'm_try' largest keys log(u)/w are selected
+		_Key.resize(n_tmp);
+		for (int i=0; i < n_tmp; i++)
+		{
+			const int k = _IdxArray[i];
+			_Key[i].first = log(unif_rand()) / _Weight[k];
+			_Key[i].second = k;
+		}
+		nth_element(_Key.begin(), _Key.begin() + (n_tmp - m_try), _Key.end());
+		for (int i=0; i < n_tmp; i++)
+			_IdxArray[i] = _Key[i].second;
 	}
 	_m_try = m_try;
 }
 
-int CSamplingWithoutReplace::NumOfSelection() const
-{
-	return _m_try;
-}
-
 void CSamplingWithoutReplace::Remove(int idx)
 {
+	// only the selected SNPs at the end are moved
 	idx = _IdxArray.size() - _m_try + idx;
 	_IdxArray.erase(_IdxArray.begin() + idx);
-}
-
-void CSamplingWithoutReplace::RemoveSelection()
-{
-	_IdxArray.resize(_IdxArray.size() - _m_try);
+	_m_try --;
 }
 
 void CSamplingWithoutReplace::RemoveFlag()
 {
+	// compact the selected SNPs in a single pass, keeping their order
 	const int n_tmp = _IdxArray.size();
-	for (int i=n_tmp-1; i >= n_tmp - _m_try; i--)
+	const int st = n_tmp - _m_try;
+	int k = st;
+	for (int i=st; i < n_tmp; i++)
 	{
-		vector<int>::iterator p = _IdxArray.begin() + i;
-		if (*p < 0) _IdxArray.erase(p);
+		if (_IdxArray[i] >= 0)
+			_IdxArray[k++] = _IdxArray[i];
 	}
-}
-
-int &CSamplingWithoutReplace::operator[] (int idx)
-{
-	return _IdxArray[_IdxArray.size() - _m_try + idx];
+	_IdxArray.resize(k);
+	_m_try = k - st;
 }
 
 
@@ -991,11 +1526,45 @@ int &CSamplingWithoutReplace::operator[] (int idx)
 // -------------------------------------------------------------------------
 // The class of SNP genotype list
 
-CAlg_EM::CAlg_EM() {}
+CAlg_EM::CAlg_EM(): _MemPair(MEM_EM_PAIR) {}
+
+/// the key of a sample consisting of packed SNP genotypes and HLA type
+static void _SampGroupKey(const TGenotype &G, size_t NumSNP,
+	const THLAType &HLA, string &Key)
+{
+	const size_t nByte = (NumSNP + 7) >> 3;
+	const UINT8 Tail = (NumSNP & 0x07) ?
+		UINT8((1 << (NumSNP & 0x07)) - 1) : UINT8(0xFF);
+	Key.resize(3*nByte + 2*sizeof(int));
+	for (size_t i=0; i < nByte; i++)
+	{
+		// the bits beyond 'NumSNP' may be left by 'ReduceSNP'
+		const UINT8 m = (i < nByte-1) ? UINT8(0xFF) : Tail;
+		Key[3*i]   = char(G.PackedSNP1[i] & m);
+		Key[3*i+1] = char(G.PackedSNP2[i] & m);
+		Key[3*i+2] = char(G.PackedMissing[i] & m);
+	}
+	memcpy(&Key[3*nByte], &HLA.Allele1, sizeof(int));
+	memcpy(&Key[3*nByte + sizeof(int)], &HLA.Allele2, sizeof(int));
+}
+
+void CAlg_EM::_SplitGroup(TSampGroup &G, const UINT8 NewGeno[],
+	const CGenotypeList &GenoList, bool in_bag)
+{
+	for (int c=0; c < 4; c++)
+		{ G.ClassCount[c] = 0; G.ClassSamp[c] = -1; }
+	vector<int>::const_iterator it;
+	for (it = G.SampIndex.begin(); it != G.SampIndex.end(); it++)
+	{
+		const int g = NewGeno[*it];
+		G.ClassCount[g] += in_bag ? GenoList.List[*it].BootstrapCount : 1;
+		if (G.ClassSamp[g] < 0) G.ClassSamp[g] = *it;
+	}
+}
 
 void CAlg_EM::PrepareHaplotypes(const CHaplotypeList &CurHaplo,
 	const CGenotypeList &GenoList, const CHLATypeList &HLAList,
-	CHaplotypeList &NextHaplo)
+	int NumInBag, CDoubleHaploList &NextHaplo)
 {
 #if (HIBAG_TIMING == 3)
 	_put_timing();
@@ -1003,236 +1572,394 @@ void CAlg_EM::PrepareHaplotypes(const CHaplotypeList &CurHaplo,
 
 	HIBAG_CHECKING(GenoList.nSamp() != HLAList.nSamp(),
 		"CAlg_EM::PrepareHaplotypes, GenoList and HLAList should have the same number of samples.");
+	HIBAG_CHECKING((NumInBag<0) || (NumInBag>GenoList.nSamp()),
+		"CAlg_EM::PrepareHaplotypes, invalid NumInBag.");
 
 	_SampHaploPair.clear();
-	_SampHaploPair.reserve(GenoList.nSamp());
-	CurHaplo.DoubleHaplos(NextHaplo);
-
-	vector<int> DiffList(GenoList.nSamp()*(2*GenoList.nSamp() + 1));
+	_OutOfBagGroup.clear();
+	_MemPair.Set(NumInBag * sizeof(THaploPairList));
+	_SampHaploPair.reserve(NumInBag);
+	size_t PairBytes = _SampHaploPair.capacity() * sizeof(THaploPairList);
+	NextHaplo.Init(CurHaplo);
+
+	// the samples with identical genotypes at the selected SNPs and the same
+	//   HLA type share the haplotype pairs, so they are merged into a group
+	//   weighted by the total count, and EM scales with the distinct patterns
+	map<string, int> InBagIdx, OutOfBagIdx, PatternIdx;
+	map<string, int>::iterator pIdx;
+	string Key;
+	// the genotype pattern of each in-bag group, ignoring HLA types
+	vector<int> GroupPattern;
+	GroupPattern.reserve(NumInBag);
+
+	// the haplotype pairs with the minimum Hamming distance are kept in
+	//   a single pass: the pair list is cleared whenever a smaller distance
+	//   is found, so no distance cache is needed and the pairs are stored
+	//   in the same order as the scan
+	int DiffArray[8];
+
+	// group out-of-bag samples
+	for (int iSamp=NumInBag; iSamp < GenoList.nSamp(); iSamp++)
+	{
+		_SampGroupKey(GenoList.List[iSamp], GenoList.Num_SNP,
+			HLAList.List[iSamp], Key);
+		pIdx = OutOfBagIdx.find(Key);
+		if (pIdx == OutOfBagIdx.end())
+		{
+			OutOfBagIdx[Key] = _OutOfBagGroup.size();
+			_OutOfBagGroup.push_back(TSampGroup());
+			_OutOfBagGroup.back().BootstrapCount = 0;
+			pIdx = OutOfBagIdx.find(Key);
+		}
+		TSampGroup &G = _OutOfBagGroup[pIdx->second];
+		G.SampIndex.push_back(iSamp);
+		G.BootstrapCount ++;
+	}
 
-	// get haplotype pairs for each sample
-	for (int iSamp=0; iSamp < GenoList.nSamp(); iSamp++)
+	// get haplotype pairs for each group of in-bag samples
+	for (int iSamp=0; iSamp < NumInBag; iSamp++)
 	{
 		const TGenotype &pG   = GenoList.List[iSamp];
 		const THLAType  &pHLA = HLAList.List[iSamp];
+		_SampGroupKey(pG, GenoList.Num_SNP, pHLA, Key);
 
-		if (pG.BootstrapCount > 0)
+		pIdx = InBagIdx.find(Key);
+		if (pIdx != InBagIdx.end())
 		{
+			THaploPairList &HP = _SampHaploPair[pIdx->second];
+			HP.SampIndex.push_back(iSamp);
+			HP.BootstrapCount += pG.BootstrapCount;
+		} else {
+			InBagIdx[Key] = _SampHaploPair.size();
 			_SampHaploPair.push_back(THaploPairList());
 			THaploPairList &HP = _SampHaploPair.back();
 			HP.BootstrapCount = pG.BootstrapCount;
-			HP.SampIndex = iSamp;
+			HP.SampIndex.push_back(iSamp);
+			HP.HLA = pHLA;
 
-			vector<THaplotype> &pH1 = NextHaplo.List[pHLA.Allele1];
-			vector<THaplotype> &pH2 = NextHaplo.List[pHLA.Allele2];
-			vector<THaplotype>::iterator p1, p2;
+			// the key without HLA type
+			const string PKey(Key, 0, Key.size() - 2*sizeof(int));
+			pIdx = PatternIdx.find(PKey);
+			if (pIdx == PatternIdx.end())
+			{
+				GroupPattern.push_back(PatternIdx.size());
+				PatternIdx[PKey] = GroupPattern.back();
+			} else
+				GroupPattern.push_back(pIdx->second);
+
+			// pairs of parent haplotypes, since the doubled haplotypes have
+			//   the same Hamming distances as their parents
+			const vector<THaplotype> &pH1 = CurHaplo.List[pHLA.Allele1];
+			const vector<THaplotype> &pH2 = CurHaplo.List[pHLA.Allele2];
+			const int s1 = NextHaplo.Start[pHLA.Allele1];
+			const int s2 = NextHaplo.Start[pHLA.Allele2];
+			const int n1 = pH1.size(), n2 = pH2.size();
 			int MinDiff = GenoList.Num_SNP * 4;
 
 			if (pHLA.Allele1 != pHLA.Allele2)
 			{
-				const size_t n2 = pH2.size();
-				const size_t m = pH1.size() * n2;
-				if (m > DiffList.size()) DiffList.resize(m);
-				int *pD = &DiffList[0];
-
-				for (p1 = pH1.begin(); p1 != pH1.end(); p1++)
+				for (int i1=0; i1 < n1; i1++)
 				{
-					p2 = pH2.begin();
-					for (size_t n=n2; n > 0; )
+					int i2 = 0;
+					for (int n=n2; n > 0; )
 					{
 						if (n >= 8)
 						{
-							pG._HamDistArray8(CurHaplo.Num_SNP, *p1, &(*p2), pD);
-							for (size_t k=8; k > 0; k--, p2++)
+							pG._HamDistArray8(CurHaplo.Num_SNP, pH1[i1], &pH2[i2], DiffArray);
+							for (size_t k=0; k < 8; k++, i2++)
 							{
-								int d = *pD++;
-								if (d < MinDiff) MinDiff = d;
-								if (d == 0)
-									HP.PairList.push_back(THaploPair(&(*p1), &(*p2)));
+								int d = DiffArray[k];
+								if (d < MinDiff)
+								{
+									MinDiff = d;
+									HP.PairList.clear();
+								}
+								if (d == MinDiff)
+									HP.PairList.push_back(THaploPair(s1+i1, s2+i2));
 							}
 							n -= 8;
 						} else {
-							int d = *pD++ = pG._HamDist(CurHaplo.Num_SNP, *p1, *p2);
-							if (d < MinDiff) MinDiff = d;
-							if (d == 0)
-								HP.PairList.push_back(THaploPair(&(*p1), &(*p2)));
-							p2++; n--;
-						}
-					}
-				}
-
-				if (MinDiff > 0)
-				{
-					int *pD = &DiffList[0];
-					for (p1 = pH1.begin(); p1 != pH1.end(); p1++)
-					{
-						for (p2 = pH2.begin(); p2 != pH2.end(); p2++)
-						{
-							if (*pD++ == MinDiff)
-								HP.PairList.push_back(THaploPair(&(*p1), &(*p2)));
+							int d = pG._HamDist(CurHaplo.Num_SNP, pH1[i1], pH2[i2]);
+							if (d < MinDiff)
+							{
+								MinDiff = d;
+								HP.PairList.clear();
+							}
+							if (d == MinDiff)
+								HP.PairList.push_back(THaploPair(s1+i1, s2+i2));
+							i2++; n--;
 						}
 					}
 				}
-
 			} else {
-				const size_t m = pH1.size() * (pH1.size() + 1) / 2;
-				if (m > DiffList.size()) DiffList.resize(m);
-				int *pD = &DiffList[0];
-
-				for (p1 = pH1.begin(); p1 != pH1.end(); p1++)
+				for (int i1=0; i1 < n1; i1++)
 				{
-					for (p2 = p1; p2 != pH1.end(); p2++)
+					for (int i2=i1; i2 < n1; i2++)
 					{
-						int d = *pD++ = pG._HamDist(CurHaplo.Num_SNP, *p1, *p2);
-						if (d < MinDiff) MinDiff = d;
-						if (d == 0)
-							HP.PairList.push_back(THaploPair(&(*p1), &(*p2)));
-					}
-				}
-
-				if (MinDiff > 0)
-				{
-					int *pD = &DiffList[0];
-					for (p1 = pH1.begin(); p1 != pH1.end(); p1++)
-					{
-						for (p2 = p1; p2 != pH1.end(); p2++)
+						int d = pG._HamDist(CurHaplo.Num_SNP, pH1[i1], pH1[i2]);
+						if (d < MinDiff)
 						{
-							if (*pD++ == MinDiff)
-								HP.PairList.push_back(THaploPair(&(*p1), &(*p2)));
+							MinDiff = d;
+							HP.PairList.clear();
 						}
+						if (d == MinDiff)
+							HP.PairList.push_back(THaploPair(s1+i1, s1+i2));
 					}
 				}
 			}
+
+			// release the space of discarded pairs
+			if (HP.PairList.capacity() > 2*HP.PairList.size())
+				vector<THaploPair>(HP.PairList).swap(HP.PairList);
+
+			PairBytes += HP.PairList.capacity() * sizeof(THaploPair);
+			_MemPair.Set(PairBytes);
 		}
 	}
 
+	// the in-bag groups ordered by genotype patterns, for screening
+	const int nPattern = PatternIdx.size();
+	_PatternStart.assign(nPattern + 1, 0);
+	for (size_t i=0; i < GroupPattern.size(); i++)
+		_PatternStart[GroupPattern[i] + 1] ++;
+	for (int i=0; i < nPattern; i++)
+		_PatternStart[i+1] += _PatternStart[i];
+	_PatternGroup.resize(GroupPattern.size());
+	{
+		vector<int> pos(_PatternStart.begin(), _PatternStart.end() - 1);
+		for (size_t i=0; i < GroupPattern.size(); i++)
+			_PatternGroup[pos[GroupPattern[i]]++] = i;
+	}
+	_ScreenCnt.assign(CurHaplo.nHLA(), 0);
+	PairBytes += (_PatternStart.capacity() + _PatternGroup.capacity() +
+		_ScreenCnt.capacity()) * sizeof(int);
+
+	// the sample indices of groups
+	vector<THaploPairList>::const_iterator p;
+	for (p = _SampHaploPair.begin(); p != _SampHaploPair.end(); p++)
+		PairBytes += p->SampIndex.capacity() * sizeof(int);
+	vector<TSampGroup>::const_iterator q;
+	PairBytes += _OutOfBagGroup.capacity() * sizeof(TSampGroup);
+	for (q = _OutOfBagGroup.begin(); q != _OutOfBagGroup.end(); q++)
+		PairBytes += q->SampIndex.capacity() * sizeof(int);
+	_MemPair.Set(PairBytes);
+
 #if (HIBAG_TIMING == 3)
 	_inc_timing();
 #endif
 }
 
-bool CAlg_EM::PrepareNewSNP(const int NewSNP, const CHaplotypeList &CurHaplo,
-	const CSNPGenoMatrix &SNPMat, CGenotypeList &GenoList,
-	CHaplotypeList &NextHaplo)
+bool CAlg_EM::PrepareNewSNP(const UINT8 NewGeno[],
+	const CGenotypeList &GenoList, CDoubleHaploList &NextHaplo, bool InitFreq)
 {
-	HIBAG_CHECKING((NewSNP<0) || (NewSNP>=SNPMat.Num_Total_SNP),
-		"CAlg_EM::PrepareNewSNP, invalid NewSNP.");
-	HIBAG_CHECKING(SNPMat.Num_Total_Samp != GenoList.nSamp(),
-		"CAlg_EM::PrepareNewSNP, SNPMat and GenoList should have the same number of SNPs.");
-
-	// compute the allele frequency of NewSNP
+	// split the in-bag groups by NewSNP, and compute its allele frequency
 	int allele_cnt = 0, valid_cnt = 0;
-	for (int iSamp=0; iSamp < SNPMat.Num_Total_Samp; iSamp++)
+	vector<THaploPairList>::iterator it;
+	for (it = _SampHaploPair.begin(); it != _SampHaploPair.end(); it++)
 	{
-		int dup = GenoList.List[iSamp].BootstrapCount;
-		if (dup > 0)
-		{
-			int g = SNPMat.Get(iSamp, NewSNP);
-			if ((0<=g) && (g<=2))
-				{ allele_cnt += g*dup; valid_cnt += 2*dup; }
-		}
+		_SplitGroup(*it, NewGeno, GenoList, true);
+		allele_cnt += it->ClassCount[1] + 2*it->ClassCount[2];
+		valid_cnt += 2*(it->ClassCount[0] + it->ClassCount[1] + it->ClassCount[2]);
 	}
 	if ((allele_cnt==0) || (allele_cnt==valid_cnt)) return false;
 
+	vector<TSampGroup>::iterator q;
+	for (q = _OutOfBagGroup.begin(); q != _OutOfBagGroup.end(); q++)
+		_SplitGroup(*q, NewGeno, GenoList, false);
+
 	// initialize the haplotype frequencies
-	CurHaplo.DoubleHaplosInitFreq(NextHaplo, double(allele_cnt)/valid_cnt);
+	if (InitFreq)
+		NextHaplo.InitFreq(double(allele_cnt)/valid_cnt);
+	return true;
+}
 
-	// update haplotype pair
-	const int IdxNewSNP = NextHaplo.Num_SNP - 1;
-	vector<THaploPairList>::iterator it;
+/// add the frequency of a doubled pair to the sum, or add it multiplied by Ratio to Freq
+static inline void _AddPairFreq(int h1, int h2, const double OldFreq[],
+	double Freq[], double Ratio, double &Sum)
+{
+	double f = (h1 != h2) ?
+		(2 * OldFreq[h1] * OldFreq[h2]) : (OldFreq[h1] * OldFreq[h2]);
+	if (Freq)
+	{
+		double v = f * Ratio;
+		Freq[h1] += v; Freq[h2] += v;
+	} else
+		Sum += f;
+}
 
-	for (it = _SampHaploPair.begin(); it != _SampHaploPair.end(); it++)
+double CAlg_EM::ScreenEntropy(const UINT8 NewGeno[],
+	const CGenotypeList &GenoList)
+{
+	const int nPattern = (int)_PatternStart.size() - 1;
+	int *pCnt = &_ScreenCnt[0];
+	double H = 0;
+
+	for (int k=0; k < nPattern; k++)
 	{
-		vector<THaploPair>::iterator p;
-		// SNP genotype
-		int geno = SNPMat.Get(it->SampIndex, NewSNP);
-		if ((0<=geno) && (geno<=2))
+		const int *pBegin = &_PatternGroup[_PatternStart[k]];
+		const int *pEnd = &_PatternGroup[0] + _PatternStart[k+1];
+		const int *p;
+		for (p = pBegin; p != pEnd; p++)
+			_SplitGroup(_SampHaploPair[*p], NewGeno, GenoList, true);
+
+		// the HLA allele counts in each cell of the genotype pattern and
+		//   the genotype at the new SNP
+		for (int c=0; c < 4; c++)
 		{
-			// for -- loop
-			for (p = it->PairList.begin(); p != it->PairList.end(); p++)
+			int N = 0;
+			for (p = pBegin; p != pEnd; p++)
 			{
-				p->Flag = ((p->H1->GetAllele(IdxNewSNP) +
-					p->H2->GetAllele(IdxNewSNP)) == geno);
+				const THaploPairList &G = _SampHaploPair[*p];
+				const int n = G.ClassCount[c];
+				pCnt[G.HLA.Allele1] += n; pCnt[G.HLA.Allele2] += n;
+				N += 2*n;
+			}
+			if (N <= 0) continue;
+			for (p = pBegin; p != pEnd; p++)
+			{
+				const THaploPairList &G = _SampHaploPair[*p];
+				const int a[2] = { G.HLA.Allele1, G.HLA.Allele2 };
+				for (int j=0; j < 2; j++)
+				{
+					const int n = pCnt[a[j]];
+					if (n > 0)
+					{
+						H -= n * log(double(n) / N);
+						pCnt[a[j]] = 0;
+					}
+				}
 			}
-		} else {
-			// for -- loop
-			for (p = it->PairList.begin(); p != it->PairList.end(); p++)
-				p->Flag = true;
 		}
 	}
 
-	return true;
+	return H;
+}
+
+double CAlg_EM::_PairFreq(const vector<THaploPair> &PairList, int Geno,
+	const double OldFreq[], double Freq[], double Ratio)
+{
+	vector<THaploPair>::const_iterator p, q, r;
+	double sum = 0;
+
+	if ((Geno == 0) || (Geno == 2))
+	{
+		// both doubled haplotypes carry the same allele
+		const int a = Geno >> 1;
+		for (p = PairList.begin(); p != PairList.end(); p++)
+			_AddPairFreq(2*p->H1 + a, 2*p->H2 + a, OldFreq, Freq, Ratio, sum);
+		return sum;
+	}
+
+	// the doubled pairs are visited in the order of scanning the doubled
+	//   haplotype lists: for each H1, its allele 0 then allele 1, and then
+	//   the pairs with the same H1 (the allele of H2 starts from the allele
+	//   of H1 if H2 is H1)
+	for (p = PairList.begin(); p != PairList.end(); p = q)
+	{
+		for (q = p; (q != PairList.end()) && (q->H1 == p->H1); q++);
+		for (int a1=0; a1 < 2; a1++)
+		{
+			const int h1 = 2*p->H1 + a1;
+			for (r = p; r != q; r++)
+			{
+				const bool same = (r->H2 == r->H1);
+				if (Geno == 1)
+				{
+					if (!same || (a1 == 0))
+						_AddPairFreq(h1, 2*r->H2 + 1 - a1, OldFreq, Freq, Ratio, sum);
+				} else {
+					for (int a2 = same ? a1 : 0; a2 < 2; a2++)
+						_AddPairFreq(h1, 2*r->H2 + a2, OldFreq, Freq, Ratio, sum);
+				}
+			}
+		}
+	}
+	return sum;
+}
+
+int CAlg_EM::ExpectationMaximization(CDoubleHaploList &NextHaplo)
+{
+	TEMState State;
+	return ExpectationMaximization(NextHaplo, State, INT_MAX);
 }
 
-void CAlg_EM::ExpectationMaximization(CHaplotypeList &NextHaplo)
+int CAlg_EM::ExpectationMaximization(CDoubleHaploList &NextHaplo,
+	TEMState &State, int MaxIter)
 {
 #if (HIBAG_TIMING == 2)
 	_put_timing();
 #endif
 
-	// the converage tolerance
-	double ConvTol = 0, LogLik = -1e+30;
-
 	// iterate ...
-	for (int iter=0; iter <= EM_MaxNum_Iterations; iter++)
+	for (int n=0; (n < MaxIter) && !State.Converged &&
+		(State.Iter <= EM_MaxNum_Iterations); n++)
 	{
 		// save old values
 		// old log likelihood
-		double Old_LogLik = LogLik;
+		double Old_LogLik = State.LogLik;
 		// old haplotype frequencies
 		NextHaplo.SaveClearFrequency();
 
 		// for-loop each sample
-		vector<THaploPairList>::iterator s;
-		vector<THaploPair>::iterator p;
+		vector<THaploPairList>::const_iterator s;
+		const double *pOld = &NextHaplo.OldFreq[0];
+		double *pFreq = &NextHaplo.Frequency[0];
 		int TotalNumSamp = 0;
-		LogLik = 0;
+		double LogLik = 0;
 
 		for (s = _SampHaploPair.begin(); s != _SampHaploPair.end(); s++)
 		{
-			// always "s->BootstrapCount > 0"
-			TotalNumSamp += s->BootstrapCount;
-
-			double psum = 0;
-			for (p = s->PairList.begin(); p != s->PairList.end(); p++)
+			// for each genotype at the new SNP (3 for missing, compatible
+			//   with all pairs)
+			for (int c=0; c < 4; c++)
 			{
-				if (p->Flag)
-				{
-					p->Freq = (p->H1 != p->H2) ?
-						(2 * p->H1->OldFreq * p->H2->OldFreq) : (p->H1->OldFreq * p->H2->OldFreq);
-					psum += p->Freq;
-				}
-			}
-			LogLik += s->BootstrapCount * log(psum);
-			psum = double(s->BootstrapCount) / psum;
+				const int cnt = s->ClassCount[c];
+				if (cnt <= 0) continue;
+				TotalNumSamp += cnt;
 
-			// update
-			for (p = s->PairList.begin(); p != s->PairList.end(); p++)
-			{
-				if (p->Flag)
-				{
-					double r = p->Freq * psum;
-					p->H1->Frequency += r; p->H2->Frequency += r;
-				}
+				double psum = _PairFreq(s->PairList, c, pOld, NULL, 0);
+				LogLik += cnt * log(psum);
+				psum = double(cnt) / psum;
+
+				// update
+				_PairFreq(s->PairList, c, pOld, pFreq, psum);
 			}
 		}
 
 		// finally
 		NextHaplo.ScaleFrequency(0.5/TotalNumSamp);
+		State.LogLik = LogLik;
 
-		if (iter > 0)
+		if (State.Iter > 0)
 		{
-			if (fabs(LogLik - Old_LogLik) <= ConvTol)
-				break;
+			if (fabs(LogLik - Old_LogLik) <= State.ConvTol)
+				State.Converged = true;
 		} else {
-			ConvTol = EM_FuncRelTol * (fabs(LogLik) + EM_FuncRelTol);
-			if (ConvTol < 0) ConvTol = 0;
+			State.ConvTol = EM_FuncRelTol * (fabs(LogLik) + EM_FuncRelTol);
+			if (State.ConvTol < 0) State.ConvTol = 0;
 		}
+		State.Iter ++;
 	}
 
 #if (HIBAG_TIMING == 2)
 	_inc_timing();
 #endif
+
+	return State.Iter;
+}
+
+size_t CAlg_EM::TotalNumOfPair() const
+{
+	size_t Cnt = 0;
+	vector<THaploPairList>::const_iterator it;
+	for (it = _SampHaploPair.begin(); it != _SampHaploPair.end(); it++)
+	{
+		// the number of doubled pairs
+		vector<THaploPair>::const_iterator p;
+		for (p = it->PairList.begin(); p != it->PairList.end(); p++)
+			Cnt += (p->H1 != p->H2) ? 4 : 3;
+	}
+	return Cnt;
 }
 
 
@@ -1240,14 +1967,48 @@ void CAlg_EM::ExpectationMaximization(CHaplotypeList &NextHaplo)
 // -------------------------------------------------------------------------
 // The algorithm of prediction
 
-CAlg_Prediction::CAlg_Prediction() { }
+CAlg_Prediction::TPlan::TPlan(TMemSubsystem Sub): Mem(Sub)
+{
+	NumHaplo = 0;
+	NumWord = 1;
+	SumWeight = 0;
+	NumSNP = 0;
+	NumHLA = 0;
+	Approx = false;
+}
+
+void CAlg_Prediction::TPlan::Clear()
+{
+	vector<uint64_t>().swap(Bits);
+	vector<int>().swap(HaploStart);
+	vector<TPlanRun>().swap(Run);
+	vector<double>().swap(Weight);
+	vector<double>().swap(TailW);
+	vector<int>().swap(Slot);
+	NumHaplo = 0;
+	NumWord = 1;
+	SumWeight = 0;
+	NumSNP = 0;
+	NumHLA = 0;
+	Approx = false;
+	Mem.Set(0);
+}
+
+CAlg_Prediction::CAlg_Prediction():
+	_MemProb(MEM_SCRATCH), _MemBlock(MEM_SCRATCH)
+{
+	_nHLA = _nPairHLA = 0;
+	SetPruneTol(0);
+	_Epsilon = 0;
+}
 
 void CAlg_Prediction::InitPrediction(int n_hla)
 {
 	HIBAG_CHECKING(n_hla<=0, "CAlg_Prediction::Init, n_hla error.");
 
 	_nHLA = n_hla;
-	const int size = n_hla*(n_hla+1)/2;
+	const int size = _nPairHLA = n_hla*(n_hla+1)/2;
+	_MemProb.Set(2 * size * sizeof(double));
 	_PostProb.resize(size);
 	_SumPostProb.resize(size);
 }
@@ -1298,214 +2059,383 @@ double &CAlg_Prediction::IndexSumPostProb(int H1, int H2)
 	return _SumPostProb[H2 + H1*(2*_nHLA-H1-1)/2];
 }
 
-void CAlg_Prediction::PredictPostProb(const CHaplotypeList &Haplo,
-	const TGenotype &Geno)
+/// descending order of haplotype frequencies
+static bool _HaploFreqGreater(const THaplotype *a, const THaplotype *b)
 {
-	vector<THaplotype>::const_iterator i1;
-	vector<THaplotype>::const_iterator i2;
-	double *pProb = &_PostProb[0];
+	return a->Frequency > b->Frequency;
+}
 
+void CAlg_Prediction::CompilePlan(const CHaplotypeList &Haplo,
+	const int BitOrder[])
+{
+	CompilePlan(Haplo, _Plan, BitOrder);
+	_HomDiff.resize(_HomDiffSize(_Plan));
+}
+
+void CAlg_Prediction::CompilePlan(const CHaplotypeList &Haplo, TPlan &P,
+	const int BitOrder[]) const
+{
+	HIBAG_CHECKING((int)Haplo.nHLA() != _nHLA,
+		"CAlg_Prediction::CompilePlan, invalid number of HLA alleles.");
+	HIBAG_CHECKING(Haplo.Num_SNP > HIBAG_MAXNUM_SNP_IN_CLASSIFIER,
+		"CAlg_Prediction::CompilePlan, too many SNPs.");
+
+	// the number of haplotypes, runs and haplotype pairs
+	size_t nHaplo = 0, nRun = 0, nPair = 0;
+	vector<int> Start(_nHLA + 1);
 	for (int h1=0; h1 < _nHLA; h1++)
 	{
-		const vector<THaplotype> &L1 = Haplo.List[h1];
-		
-		// diag value
-		*pProb = 0;
-		for (i1=L1.begin(); i1 != L1.end(); i1++)
+		const size_t n1 = Haplo.List[h1].size();
+		Start[h1] = nHaplo;
+		nHaplo += n1;
+		nRun += n1 * (_nHLA - h1);
+		nPair += n1 * (n1 + 1) / 2;
+		for (int h2=h1+1; h2 < _nHLA; h2++)
+			nPair += n1 * Haplo.List[h2].size();
+	}
+	Start[_nHLA] = nHaplo;
+
+	P.NumSNP = Haplo.Num_SNP;
+	P.NumHaplo = nHaplo;
+	P.NumWord = (P.NumSNP + 63) / 64;
+	if (P.NumWord <= 0) P.NumWord = 1;
+	P.Mem.Set(nHaplo*P.NumWord*sizeof(uint64_t) +
+		nRun*sizeof(TPlanRun) + nPair*sizeof(double) +
+		(_nPairHLA+1)*sizeof(int) + (2*nHaplo + 3*_nHLA + 1)*sizeof(int) +
+		(_Epsilon > 0 ? nPair*sizeof(double) : 0));
+	P.HaploStart = Start;
+	P.NumHLA = _nHLA;
+	P.Approx = (_Epsilon > 0);
+
+	// the order of haplotypes for each HLA allele, by descending frequency
+	//   in the approximate mode
+	vector<const THaplotype*> Ord(nHaplo);
+	for (int h=0; h < _nHLA; h++)
+	{
+		const vector<THaplotype> &L = Haplo.List[h];
+		for (size_t i=0; i < L.size(); i++)
+			Ord[Start[h] + i] = &L[i];
+		if (_Epsilon > 0)
 		{
-			for (i2=i1; i2 != L1.end(); i2++)
+			std::stable_sort(Ord.begin() + Start[h], Ord.begin() + Start[h+1],
+				_HaploFreqGreater);
+		}
+	}
+
+	// packed haplotypes
+	P.Bits.resize(nHaplo * P.NumWord);
+	uint64_t *pB = nHaplo ? &P.Bits[0] : NULL;
+	for (size_t i=0; i < nHaplo; i++)
+	{
+		if (BitOrder)
+		{
+			// reorder SNPs
+			UINT8 buf[HIBAG_PACKED_UTYPE_MAXNUM];
+			memset(buf, 0, sizeof(buf));
+			const UINT8 *h = Ord[i]->PackedHaplo;
+			for (size_t k=0; k < P.NumSNP; k++)
 			{
-				*pProb += FREQ_MUTANT((i1 != i2) ?
-					(2 * i1->Frequency * i2->Frequency) : (i1->Frequency * i2->Frequency),
-					Geno._HamDist(Haplo.Num_SNP, *i1, *i2));
+				const int j = BitOrder[k];
+				buf[k >> 3] |= ((h[j >> 3] >> (j & 0x07)) & 0x01) << (k & 0x07);
 			}
+			memcpy(pB, buf, P.NumWord*sizeof(uint64_t));
+		} else
+			memcpy(pB, Ord[i]->PackedHaplo, P.NumWord*sizeof(uint64_t));
+		pB += P.NumWord;
+	}
+
+	// haplotype pairs in the same order as the nested lists, with the
+	//   frequencies computed in the same way as before
+	P.Run.clear();
+	P.Run.reserve(nRun);
+	P.Weight.resize(nPair);
+	P.Slot.resize(_nPairHLA + 1);
+	double *pW = nPair ? &P.Weight[0] : NULL;
+	int idx = 0;
+	for (int h1=0; h1 < _nHLA; h1++)
+	{
+		// diag value
+		P.Slot[idx++] = P.Run.size();
+		for (int k1=Start[h1]; k1 < Start[h1+1]; k1++)
+		{
+			TPlanRun R = { k1, k1, Start[h1+1] - k1,
+				(size_t)(pW - &P.Weight[0]) };
+			P.Run.push_back(R);
+			const double f1 = Ord[k1]->Frequency;
+			*pW++ = f1 * f1;
+			for (int k2=k1+1; k2 < Start[h1+1]; k2++)
+				*pW++ = 2 * f1 * Ord[k2]->Frequency;
 		}
-		pProb ++;
 
 		// off-diag value
 		for (int h2=h1+1; h2 < _nHLA; h2++)
 		{
-			const vector<THaplotype> &L2 = Haplo.List[h2];
-			*pProb = 0;
-			for (i1=L1.begin(); i1 != L1.end(); i1++)
+			P.Slot[idx++] = P.Run.size();
+			for (int k1=Start[h1]; k1 < Start[h1+1]; k1++)
 			{
-				for (i2=L2.begin(); i2 != L2.end(); i2++)
-				{
-					*pProb += FREQ_MUTANT(2 * i1->Frequency * i2->Frequency,
-						Geno._HamDist(Haplo.Num_SNP, *i1, *i2));
-				}
+				TPlanRun R = { k1, Start[h2], Start[h2+1] - Start[h2],
+					(size_t)(pW - &P.Weight[0]) };
+				P.Run.push_back(R);
+				const double ss = 2 * Ord[k1]->Frequency;
+				for (int k2=Start[h2]; k2 < Start[h2+1]; k2++)
+					*pW++ = ss * Ord[k2]->Frequency;
 			}
-			pProb ++;
 		}
 	}
+	P.Slot[idx] = P.Run.size();
+	P.SumWeight = 0;
+	for (size_t i=0; i < nPair; i++) P.SumWeight += P.Weight[i];
 
-	// normalize
-	double sum = 0;
-	double *p = &_PostProb[0];
-	for (size_t n = _PostProb.size(); n > 0; n--) sum += *p++;
-	sum = 1.0 / sum;
-	p = &_PostProb[0];
-	for (size_t n = _PostProb.size(); n > 0; n--) *p++ *= sum;
+	// the remaining frequencies of each run in the approximate mode
+	if (_Epsilon > 0)
+	{
+		P.TailW.resize(nPair);
+		vector<TPlanRun>::const_iterator r;
+		for (r=P.Run.begin(); r != P.Run.end(); r++)
+		{
+			double sum = 0;
+			for (int j=r->NumH2-1; j >= 0; j--)
+			{
+				sum += P.Weight[r->IdxW + j];
+				P.TailW[r->IdxW + j] = sum;
+			}
+		}
+	} else
+		P.TailW.clear();
 }
 
-THLAType CAlg_Prediction::_PredBestGuess(const CHaplotypeList &Haplo,
-	const TGenotype &Geno)
+void CAlg_Prediction::SetPruneTol(double tol)
 {
-	THLAType rv;
-	rv.Allele1 = rv.Allele2 = NA_INTEGER;
-	double max=0, prob;
+	HIBAG_CHECKING(!R_finite(tol) || tol < 0,
+		"CAlg_Prediction::SetPruneTol, invalid tolerance.");
+	_PruneTol = tol;
+	// EXP_LOG_MIN_RARE_FREQ[] is non-increasing, and exactly ZERO for
+	//   large distances, so tol = 0 only skips the pairs of ZERO frequency
+	const int n = 2 * HIBAG_MAXNUM_SNP_IN_CLASSIFIER;
+	_PruneDist = _ExactDist = INT_MAX;
+	for (int i=n-1; i >= 0; i--)
+	{
+		if (EXP_LOG_MIN_RARE_FREQ[i] <= tol) _PruneDist = i;
+		if (EXP_LOG_MIN_RARE_FREQ[i] <= 0) _ExactDist = i;
+	}
+}
 
-	vector<THaplotype>::const_iterator i1;
-	vector<THaplotype>::const_iterator i2;
+void CAlg_Prediction::SetEpsilon(double eps)
+{
+	HIBAG_CHECKING(!R_finite(eps) || eps < 0 || eps >= 1,
+		"CAlg_Prediction::SetEpsilon, invalid epsilon.");
+	_Epsilon = eps;
+}
 
-	for (int h1=0; h1 < _nHLA; h1++)
+void CAlg_Prediction::_DecompGeno(const TPlan &P, const TGenotype &Geno,
+	TGenoDecomp &Out, int OutHomDiff[]) const
+{
+	// non-missing sites, masked by bytes for the independence of endianness
+	const size_t nByte = P.NumWord * sizeof(uint64_t);
+	UINT8 M[HIBAG_PACKED_UTYPE_MAXNUM];
+	memset(M, 0, sizeof(M));
+	const size_t nFull = P.NumSNP >> 3;
+	memcpy(M, Geno.PackedMissing, nFull);
+	if (P.NumSNP & 0x07)
+		M[nFull] = Geno.PackedMissing[nFull] & ~(0xFF << (P.NumSNP & 0x07));
+
+	uint64_t S1[HIBAG_PACKED_UTYPE_MAXNUM/8], S2[HIBAG_PACKED_UTYPE_MAXNUM/8];
+	uint64_t V[HIBAG_PACKED_UTYPE_MAXNUM/8], Hom[HIBAG_PACKED_UTYPE_MAXNUM/8];
+	memcpy(S1, Geno.PackedSNP1, nByte);
+	memcpy(S2, Geno.PackedSNP2, nByte);
+	memcpy(V, M, nByte);
+
+	// heterozygous: (S1=1, S2=0), homozygous: S1 = S2 = allele
+	Out.NumHet = 0;
+	for (int w=0; w < P.NumWord; w++)
 	{
-		const vector<THaplotype> &L1 = Haplo.List[h1];
+		Out.HetMask[w] = (S1[w] ^ S2[w]) & V[w];
+		Hom[w] = ~(S1[w] ^ S2[w]) & V[w];
+		Out.NumHet += POPCNT_U64(Out.HetMask[w]);
+	}
 
-		// diag value
-		prob = 0;
-		for (i1=L1.begin(); i1 != L1.end(); i1++)
-		{
-			for (i2=i1; i2 != L1.end(); i2++)
-			{
-				prob += FREQ_MUTANT((i1 != i2) ?
-					(2 * i1->Frequency * i2->Frequency) : (i1->Frequency * i2->Frequency),
-					Geno._HamDist(Haplo.Num_SNP, *i1, *i2));
-			}
-		}
-		if (max < prob)
+	// mismatches at homozygous sites
+	const uint64_t *pB = P.NumHaplo ? &P.Bits[0] : NULL;
+	for (int i=0; i < P.NumHaplo; i++)
+	{
+		int d = 0;
+		for (int w=0; w < P.NumWord; w++)
+			d += POPCNT_U64((*pB++ ^ S1[w]) & Hom[w]);
+		OutHomDiff[i] = d;
+	}
+
+	// the minimum and maximum for each HLA allele
+	int *pMin = OutHomDiff + P.NumHaplo, *pMax = pMin + _nHLA;
+	for (int h=0; h < _nHLA; h++)
+	{
+		int vmin = INT_MAX/4, vmax = -1;
+		for (int i=P.HaploStart[h]; i < P.HaploStart[h+1]; i++)
 		{
-			max = prob;
-			rv.Allele1 = rv.Allele2 = h1;
+			const int d = OutHomDiff[i];
+			if (d < vmin) vmin = d;
+			if (d > vmax) vmax = d;
 		}
+		pMin[h] = vmin; pMax[h] = vmax;
+	}
+}
 
-		// off-diag value
-		for (int h2=h1+1; h2 < _nHLA; h2++)
+inline double CAlg_Prediction::_SlotProb(const TPlan &P, int idx, int h2,
+	const TGenoDecomp &G, const int HomDiff[], int D) const
+{
+	if (P.Slot[idx+1] <= P.Slot[idx]) return 0;
+	const uint64_t *pB = &P.Bits[0];
+	const int nW = P.NumWord;
+	const int MinHom2 = HomDiff[P.NumHaplo + h2];
+	const int MaxHom2 = HomDiff[P.NumHaplo + _nHLA + h2];
+	double prob = 0;
+
+	const TPlanRun *pR = &P.Run[0] + P.Slot[idx];
+	for (int r=P.Slot[idx+1]-P.Slot[idx]; r > 0; r--, pR++)
+	{
+		// the lower bounds of distances in the run
+		const int Hom1 = HomDiff[pR->IdxH1];
+		if (Hom1 + MinHom2 >= D) continue;
+		const bool all = (Hom1 + MaxHom2 < D);
+
+		const uint64_t *h1 = pB + pR->IdxH1 * nW;
+		const uint64_t *h2 = pB + pR->IdxH2 * nW;
+		const int *pD = &HomDiff[pR->IdxH2];
+		const double *pW = &P.Weight[pR->IdxW];
+		const int base = Hom1 + G.NumHet;
+		if (nW == 1)
 		{
-			const vector<THaplotype> &L2 = Haplo.List[h2];
-			const size_t n2 = L2.size();
-			prob = 0;
-			for (i1=L1.begin(); i1 != L1.end(); i1++)
+			const uint64_t H1 = h1[0] , Het = G.HetMask[0];
+			for (int n=pR->NumH2; n > 0; n--, h2++, pD++, pW++)
 			{
-				i2 = L2.begin();
-				for (size_t n=n2; n > 0; )
-				{
-					if (n >= 8)
-					{
-						int d[8];
-						Geno._HamDistArray8(Haplo.Num_SNP, *i1, &(*i2), d);
-						const double ss = 2 * i1->Frequency;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[0]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[1]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[2]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[3]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[4]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[5]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[6]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[7]); i2++;
-						n -= 8;
-					} else {
-						prob += FREQ_MUTANT(2 * i1->Frequency * i2->Frequency,
-							Geno._HamDist(Haplo.Num_SNP, *i1, *i2));
-						i2 ++; n --;
-					}
-				}
+				if (!all && (Hom1 + (*pD) >= D)) continue;
+				int d = base + (*pD) - POPCNT_U64((H1 ^ (*h2)) & Het);
+				prob += FREQ_MUTANT(*pW, d);
 			}
-			if (max < prob)
+		} else {
+			for (int n=pR->NumH2; n > 0; n--, h2+=nW, pD++, pW++)
 			{
-				max = prob;
-				rv.Allele1 = h1; rv.Allele2 = h2;
+				if (!all && (Hom1 + (*pD) >= D)) continue;
+				int d = base + (*pD);
+				for (int w=0; w < nW; w++)
+					d -= POPCNT_U64((h1[w] ^ h2[w]) & G.HetMask[w]);
+				prob += FREQ_MUTANT(*pW, d);
 			}
 		}
 	}
 
-	return rv;
+	return prob;
 }
 
-double CAlg_Prediction::_PredPostProb(const CHaplotypeList &Haplo,
-	const TGenotype &Geno, const THLAType &HLA)
+void CAlg_Prediction::PredictPostProb(const TGenotype &Geno)
 {
-	int H1=HLA.Allele1, H2=HLA.Allele2;
-	if (H1 > H2) std::swap(H1, H2);
-	int IxHLA = H2 + H1*(2*_nHLA-H1-1)/2;
-	int idx = 0;
+	TGenoDecomp G;
+	int *pDiff = _HomDiff.empty() ? NULL : &_HomDiff[0];
+	_DecompGeno(_Plan, Geno, G, pDiff);
 
-	double sum=0, hlaProb=0, prob;
-	vector<THaplotype>::const_iterator i1;
-	vector<THaplotype>::const_iterator i2;
+	double sum = _SlotProbAll(_Plan, G, pDiff, _PruneDist, &_PostProb[0]);
+	// all pairs are pruned, fall back to the exact prediction
+	if (sum <= 0 && _PruneDist < _ExactDist)
+		sum = _SlotProbAll(_Plan, G, pDiff, _ExactDist, &_PostProb[0]);
 
+	// normalize
+	sum = 1.0 / sum;
+	double *s = &_PostProb[0];
+	for (size_t n = _PostProb.size(); n > 0; n--) *s++ *= sum;
+}
+
+double CAlg_Prediction::_SlotProbAll(const TPlan &P, const TGenoDecomp &G,
+	const int HomDiff[], int D, double Out[]) const
+{
+	double *p = Out;
+	int idx = 0;
 	for (int h1=0; h1 < _nHLA; h1++)
 	{
-		const vector<THaplotype> &L1 = Haplo.List[h1];
+		for (int h2=h1; h2 < _nHLA; h2++, idx++)
+			*p++ = _SlotProb(P, idx, h2, G, HomDiff, D);
+	}
 
-		// diag value
-		prob = 0;
-		for (i1=L1.begin(); i1 != L1.end(); i1++)
-		{
-			for (i2=i1; i2 != L1.end(); i2++)
-			{
-				prob += FREQ_MUTANT((i1 != i2) ?
-					(2 * i1->Frequency * i2->Frequency) : (i1->Frequency * i2->Frequency),
-					Geno._HamDist(Haplo.Num_SNP, *i1, *i2));
-			}
-		}
-		if (IxHLA == idx) hlaProb = prob;
-		idx ++; sum += prob;
+	double sum = 0;
+	p = Out;
+	for (int n=_nPairHLA; n > 0; n--) sum += *p++;
+	return sum;
+}
 
-		// off-diag value
-		for (int h2=h1+1; h2 < _nHLA; h2++)
+double CAlg_Prediction::_SlotProbApprox(const TPlan &P,
+	const TGenoDecomp &G, const int HomDiff[], double Out[],
+	double &OutBound) const
+{
+	// Let T be the sum over all slots, and B be the sum of frequencies of
+	//   the skipped pairs. Since B <= eps * (the running sum) <= eps * T at
+	//   any time, the error of each posterior probability is <= B / T
+	const uint64_t *pB = P.Bits.empty() ? NULL : &P.Bits[0];
+	const int nW = P.NumWord;
+	const int D = _ExactDist;
+	const int *MinHom = HomDiff + P.NumHaplo;
+	double T = 0, B = 0;
+	int idx = 0;
+
+	for (int h1=0; h1 < _nHLA; h1++)
+	{
+		for (int h2=h1; h2 < _nHLA; h2++, idx++)
 		{
-			const vector<THaplotype> &L2 = Haplo.List[h2];
-			const size_t n2 = L2.size();
-			prob = 0;
-			for (i1=L1.begin(); i1 != L1.end(); i1++)
+			double prob = 0;
+			const TPlanRun *pR = P.Run.empty() ? NULL :
+				&P.Run[0] + P.Slot[idx];
+			for (int r=P.Slot[idx+1]-P.Slot[idx]; r > 0; r--, pR++)
 			{
-				i2 = L2.begin();
-				for (size_t n=n2; n > 0; )
+				const int Hom1 = HomDiff[pR->IdxH1];
+				const int lb = Hom1 + MinHom[h2];
+				if (lb >= D) continue;
+				const double lbExp = EXP_LOG_MIN_RARE_FREQ[lb];
+
+				const uint64_t *ph1 = pB + pR->IdxH1 * nW;
+				const uint64_t *ph2 = pB + pR->IdxH2 * nW;
+				const int *pD = &HomDiff[pR->IdxH2];
+				const double *pW = &P.Weight[pR->IdxW];
+				const double *pTail = &P.TailW[pR->IdxW];
+				for (int n=pR->NumH2; n > 0; n--, ph2+=nW, pD++, pW++, pTail++)
 				{
-					if (n >= 8)
-					{
-						int d[8];
-						Geno._HamDistArray8(Haplo.Num_SNP, *i1, &(*i2), d);
-						const double ss = 2 * i1->Frequency;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[0]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[1]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[2]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[3]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[4]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[5]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[6]); i2++;
-						prob += FREQ_MUTANT(ss * i2->Frequency, d[7]); i2++;
-						n -= 8;
-					} else {
-						prob += FREQ_MUTANT(2 * i1->Frequency * i2->Frequency,
-							Geno._HamDist(Haplo.Num_SNP, *i1, *i2));
-						i2 ++; n --;
-					}
+					// the remaining pairs in the run
+					const double tail = (*pTail) * lbExp;
+					if (B + tail <= _Epsilon * (T + prob))
+						{ B += tail; break; }
+					int d = Hom1 + (*pD);
+					if (d >= D) continue;
+					d += G.NumHet;
+					for (int w=0; w < nW; w++)
+						d -= POPCNT_U64((ph1[w] ^ ph2[w]) & G.HetMask[w]);
+					prob += FREQ_MUTANT(*pW, d);
 				}
 			}
-			if (IxHLA == idx) hlaProb = prob;
-			idx ++; sum += prob;
+			Out[idx] = prob;
+			T += prob;
 		}
 	}
 
-	return hlaProb / sum;
+	OutBound = (T > 0) ? (B / T) : 0;
+	return T;
 }
 
-THLAType CAlg_Prediction::BestGuess()
+THLAType CAlg_Prediction::_PredBestGuess(const TGenotype &Geno)
 {
 	THLAType rv;
 	rv.Allele1 = rv.Allele2 = NA_INTEGER;
-
-	double *p = &_PostProb[0];
 	double max = 0;
+
+	TGenoDecomp G;
+	int *pDiff = _HomDiff.empty() ? NULL : &_HomDiff[0];
+	_DecompGeno(_Plan, Geno, G, pDiff);
+
+	int idx = 0;
+
 	for (int h1=0; h1 < _nHLA; h1++)
 	{
-		for (int h2=h1; h2 < _nHLA; h2++, p++)
+		for (int h2=h1; h2 < _nHLA; h2++, idx++)
 		{
-			if (max < *p)
+			double prob = _SlotProb(_Plan, idx, h2, G, pDiff, _PruneDist);
+			if (max < prob)
 			{
-				max = *p;
+				max = prob;
 				rv.Allele1 = h1; rv.Allele2 = h2;
 			}
 		}
@@ -1514,12 +2444,46 @@ THLAType CAlg_Prediction::BestGuess()
 	return rv;
 }
 
+double CAlg_Prediction::_PredPostProb(const TGenotype &Geno,
+	const THLAType &HLA)
+{
+	const int IxHLA = IndexPair(HLA.Allele1, HLA.Allele2);
+	double sum=0, hlaProb=0;
+
+	TGenoDecomp G;
+	int *pDiff = _HomDiff.empty() ? NULL : &_HomDiff[0];
+	_DecompGeno(_Plan, Geno, G, pDiff);
+
+	int idx = 0;
+
+	for (int h1=0; h1 < _nHLA; h1++)
+	{
+		for (int h2=h1; h2 < _nHLA; h2++, idx++)
+		{
+			double prob = _SlotProb(_Plan, idx, h2, G, pDiff, _PruneDist);
+			if (IxHLA == idx) hlaProb = prob;
+			sum += prob;
+		}
+	}
+
+	return hlaProb / sum;
+}
+
+THLAType CAlg_Prediction::BestGuess()
+{
+	return _BestGuess(&_PostProb[0]);
+}
+
 THLAType CAlg_Prediction::BestGuessEnsemble()
+{
+	return _BestGuess(&_SumPostProb[0]);
+}
+
+THLAType CAlg_Prediction::_BestGuess(const double *p) const
 {
 	THLAType rv;
 	rv.Allele1 = rv.Allele2 = NA_INTEGER;
 
-	double *p = &_SumPostProb[0];
 	double max = 0;
 	for (int h1=0; h1 < _nHLA; h1++)
 	{
@@ -1536,44 +2500,323 @@ THLAType CAlg_Prediction::BestGuessEnsemble()
 	return rv;
 }
 
+void CAlg_Prediction::InitBlockBuffer()
+{
+	const size_t size = (size_t)HIBAG_PREDICT_BLOCK_SIZE * _nPairHLA;
+	_MemBlock.Set(2 * size * sizeof(double) +
+		3 * HIBAG_PREDICT_BLOCK_SIZE * sizeof(double));
+	_BlockPostProb.resize(size);
+	_BlockSumPostProb.resize(size);
+	_BlockSumWeight.resize(HIBAG_PREDICT_BLOCK_SIZE);
+	_BlockErrBound.resize(HIBAG_PREDICT_BLOCK_SIZE);
+	_BlockSumErrBound.resize(HIBAG_PREDICT_BLOCK_SIZE);
+}
+
+void CAlg_Prediction::InitSumPostProbBlock()
+{
+	memset(&_BlockSumPostProb[0], 0, _BlockSumPostProb.size()*sizeof(double));
+	memset(&_BlockSumWeight[0], 0, _BlockSumWeight.size()*sizeof(double));
+	memset(&_BlockErrBound[0], 0, _BlockErrBound.size()*sizeof(double));
+	memset(&_BlockSumErrBound[0], 0, _BlockSumErrBound.size()*sizeof(double));
+}
+
+void CAlg_Prediction::PredictPostProbBlock(const TPlan &P,
+	const TGenotype Geno[], const int Index[], int n)
+{
+	HIBAG_CHECKING(n > HIBAG_PREDICT_BLOCK_SIZE,
+		"CAlg_Prediction::PredictPostProbBlock, too many samples.");
+	HIBAG_CHECKING(!PlanUpToDate(P),
+		"CAlg_Prediction::PredictPostProbBlock, the plan should be recompiled.");
+
+	// decompose the genotypes of samples in the block
+	TGenoDecomp G[HIBAG_PREDICT_BLOCK_SIZE];
+	double *pOut[HIBAG_PREDICT_BLOCK_SIZE];
+	double Sum[HIBAG_PREDICT_BLOCK_SIZE];
+	int Hom1[HIBAG_PREDICT_BLOCK_SIZE], Act[HIBAG_PREDICT_BLOCK_SIZE];
+	const size_t nDiff = _HomDiffSize(P);
+	vector<int> HomDiff((size_t)n * nDiff + 1);
+	for (int k=0; k < n; k++)
+	{
+		_DecompGeno(P, Geno[Index[k]], G[k], &HomDiff[(size_t)k*nDiff]);
+		pOut[k] = &_BlockPostProb[(size_t)Index[k] * _nPairHLA];
+	}
+
+	// the approximate mode, sample by sample
+	if (_Epsilon > 0)
+	{
+		for (int k=0; k < n; k++)
+		{
+			double sum = _SlotProbApprox(P, G[k], &HomDiff[(size_t)k*nDiff],
+				pOut[k], _BlockErrBound[Index[k]]);
+			sum = 1.0 / sum;
+			double *s = pOut[k];
+			for (int i=_nPairHLA; i > 0; i--) *s++ *= sum;
+		}
+		return;
+	}
+
+	// each haplotype pair is loaded once for all samples in the block,
+	//   and the posterior probabilities are summed up in the same order
+	//   as PredictPostProb(), skipping the same pairs
+	const uint64_t *pB = P.Bits.empty() ? NULL : &P.Bits[0];
+	const int nW = P.NumWord;
+	const int D = _PruneDist;
+	const int *pHD = &HomDiff[0];
+	int idx = 0;
+
+	for (int h1=0; h1 < _nHLA; h1++)
+	{
+		for (int h2=h1; h2 < _nHLA; h2++, idx++)
+		{
+			for (int k=0; k < n; k++) Sum[k] = 0;
+			const TPlanRun *pR = P.Run.empty() ? NULL :
+				&P.Run[0] + P.Slot[idx];
+			for (int r=P.Slot[idx+1]-P.Slot[idx]; r > 0; r--, pR++)
+			{
+				// samples with a possibly nonzero contribution in the run
+				int nAct = 0;
+				for (int k=0; k < n; k++)
+				{
+					const int *p = pHD + k*nDiff;
+					Hom1[k] = p[pR->IdxH1];
+					if (Hom1[k] + p[P.NumHaplo + h2] < D)
+						Act[nAct++] = k;
+				}
+				if (nAct <= 0) continue;
+
+				const uint64_t *ph1 = pB + pR->IdxH1 * nW;
+				const uint64_t *ph2 = pB + pR->IdxH2 * nW;
+				const double *pW = &P.Weight[pR->IdxW];
+				for (int m=pR->NumH2, i2=pR->IdxH2; m > 0; m--, i2++, ph2+=nW, pW++)
+				{
+					uint64_t X[HIBAG_PACKED_UTYPE_MAXNUM/8];
+					for (int w=0; w < nW; w++) X[w] = ph1[w] ^ ph2[w];
+					const double f = *pW;
+					for (int a=0; a < nAct; a++)
+					{
+						const int k = Act[a];
+						const int lb = Hom1[k] + pHD[k*nDiff + i2];
+						if (lb >= D) continue;
+						int d = lb + G[k].NumHet;
+						for (int w=0; w < nW; w++)
+							d -= POPCNT_U64(X[w] & G[k].HetMask[w]);
+						Sum[k] += FREQ_MUTANT(f, d);
+					}
+				}
+			}
+			for (int k=0; k < n; k++) pOut[k][idx] = Sum[k];
+		}
+	}
+
+	// normalize
+	for (int k=0; k < n; k++)
+	{
+		double sum = 0;
+		double *s = pOut[k];
+		for (int i=_nPairHLA; i > 0; i--) sum += *s++;
+		if (_PruneDist < _ExactDist)
+		{
+			if (sum > 0)
+			{
+				// the skipped pairs sum up to at most B = SumWeight *
+				//   MIN_RARE_FREQ^D, so the error of each posterior
+				//   probability is <= B / (sum + B)
+				const double B = P.SumWeight * EXP_LOG_MIN_RARE_FREQ[D];
+				_BlockErrBound[Index[k]] = B / (sum + B);
+			} else {
+				// all pairs are pruned, fall back to the exact prediction
+				sum = _SlotProbAll(P, G[k], pHD + k*nDiff, _ExactDist, pOut[k]);
+				_BlockErrBound[Index[k]] = 0;
+			}
+		}
+		sum = 1.0 / sum;
+		s = pOut[k];
+		for (int i=_nPairHLA; i > 0; i--) *s++ *= sum;
+	}
+}
+
+void CAlg_Prediction::AddProbToSumBlock(int i, const double weight)
+{
+	if (weight > 0)
+	{
+		const double *p = &_BlockPostProb[(size_t)i * _nPairHLA];
+		double *s = &_BlockSumPostProb[(size_t)i * _nPairHLA];
+		for (int n = _nPairHLA; n > 0; n--, s++, p++)
+			*s += (*p) * weight;
+		_BlockSumWeight[i] += weight;
+		_BlockSumErrBound[i] += _BlockErrBound[i] * weight;
+	}
+}
+
+void CAlg_Prediction::AddVoteToSumBlock(int i)
+{
+	THLAType pd = _BestGuess(&_BlockPostProb[(size_t)i * _nPairHLA]);
+	if ((pd.Allele1 != NA_INTEGER) && (pd.Allele2 != NA_INTEGER))
+	{
+		const size_t k = (size_t)i * _nPairHLA +
+			IndexPair(pd.Allele1, pd.Allele2);
+		_BlockSumPostProb[k] += 1.0;
+		_BlockSumWeight[i] += 1.0;
+		_BlockSumErrBound[i] += _BlockErrBound[i];
+	}
+}
+
+void CAlg_Prediction::NormalizeSumPostProbBlock()
+{
+	for (int i=0; i < HIBAG_PREDICT_BLOCK_SIZE; i++)
+	{
+		if (_BlockSumWeight[i] > 0)
+		{
+			const double scale = 1.0 / _BlockSumWeight[i];
+			double *s = &_BlockSumPostProb[(size_t)i * _nPairHLA];
+			for (int n = _nPairHLA; n > 0; n--)
+				*s++ *= scale;
+			_BlockSumErrBound[i] *= scale;
+		}
+	}
+}
+
+THLAType CAlg_Prediction::BestGuessEnsembleBlock(int i) const
+{
+	return _BestGuess(&_BlockSumPostProb[(size_t)i * _nPairHLA]);
+}
+
+bool CAlg_Prediction::SettledBlock(int i, double tol, int n_remain) const
+{
+	const double W = _BlockSumWeight[i];
+	if (W <= 0) return false;
+	if (n_remain <= 0) return true;
+	const double *s = &_BlockSumPostProb[(size_t)i * _nPairHLA];
+
+	// the best and the second best
+	int i1 = -1, i2 = -1;
+	for (int j=0; j < _nPairHLA; j++)
+	{
+		if ((i1 < 0) || (s[j] > s[i1]))
+			{ i2 = i1; i1 = j; }
+		else if ((i2 < 0) || (s[j] > s[i2]))
+			i2 = j;
+	}
+
+	// each remaining classifier adds a weight of at most one, so the sum of
+	//   any pair grows by at most 'n_remain', and the averaged posterior m of
+	//   the best pair moves by at most n_remain/(W+n_remain)*max(m, 1-m)
+	if ((i2 >= 0) && !(s[i1] > s[i2] + n_remain))
+		return false;
+	const double m = s[i1] / W;
+	return n_remain / (W + n_remain) * std::max(m, 1 - m) <= tol;
+}
+
 
 
 // -------------------------------------------------------------------------
 // The algorithm of variable selection
 
-CVariableSelection::CVariableSelection()
+CVariableSelection::CVariableSelection():
+	_MemGeno(MEM_GENOTYPE), _MemHaplo(MEM_HAPLOTYPE), _MemHalving(MEM_SCRATCH)
 {
 	_SNPMat = NULL;
 	_HLAList = NULL;
+	_NumInBag = 0;
+	_ScreenFrac = 1;
+	_Halving = false;
+}
+
+void CVariableSelection::SetHalving(bool halving)
+{
+	_Halving = halving;
+}
+
+void CVariableSelection::SetScreen(double frac)
+{
+	if (!R_finite(frac) || (frac <= 0) || (frac > 1))
+		throw ErrHLA("Invalid fraction of screening candidate SNPs.");
+	_ScreenFrac = frac;
+}
+
+void CVariableSelection::InitSelection(CSNPGenoMatrix &snpMat,
+	CHLATypeList &hlaList, const int _BootstrapCnt[])
+{
+	HIBAG_CHECKING(snpMat.Num_Total_Samp != hlaList.nSamp(),
+		"CVariableSelection::InitSelection, snpMat and hlaList should have the same number of samples.");
+
+	_SNPMat = &snpMat;
+	_HLAList = &hlaList;
+
+	const int n_samp = snpMat.Num_Total_Samp;
+	const int n_snp  = snpMat.Num_Total_SNP;
+
+	// the in-bag samples followed by the out-of-bag samples, in the
+	//   original order within each partition
+	vector<int> Idx;
+	Idx.reserve(n_samp);
+	for (int i=0; i < n_samp; i++)
+		if (_BootstrapCnt[i] > 0) Idx.push_back(i);
+	_NumInBag = Idx.size();
+	for (int i=0; i < n_samp; i++)
+		if (_BootstrapCnt[i] <= 0) Idx.push_back(i);
+
+	_MemGeno.Set(n_samp * (sizeof(TGenotype) + sizeof(THLAType)) +
+		size_t(n_samp) * n_snp);
+
+	// initialize genotype list and HLA types
+	_GenoList.List.resize(n_samp);
+	_PartHLA.List.resize(n_samp);
+	for (int i=0; i < n_samp; i++)
+	{
+		_GenoList.List[i].BootstrapCount = _BootstrapCnt[Idx[i]];
+		_PartHLA.List[i] = hlaList.List[Idx[i]];
+	}
+	_GenoList.Num_SNP = 0;
+
+	// SNP-major genotypes, avoiding strided access to the genotype matrix
+	_PartGeno.resize(size_t(n_samp) * n_snp);
+	for (int i=0; i < n_samp; i++)
+	{
+		const int *pG = snpMat.Get(Idx[i]);
+		UINT8 *p = &_PartGeno[i];
+		for (int j=0; j < n_snp; j++, p += n_samp)
+		{
+			const int g = pG[j];
+			*p = ((0<=g) && (g<=2)) ? g : 3;
+		}
+	}
+
+	_Predict.InitPrediction(nHLA());
 }
 
-void CVariableSelection::InitSelection(CSNPGenoMatrix &snpMat,
-	CHLATypeList &hlaList, const int _BootstrapCnt[])
+void CVariableSelection::DoneSelection()
 {
-	HIBAG_CHECKING(snpMat.Num_Total_Samp != hlaList.nSamp(),
-		"CVariableSelection::InitSelection, snpMat and hlaList should have the same number of samples.");
-
-	_SNPMat = &snpMat;
-	_HLAList = &hlaList;
-	
-	// initialize genotype list
-	_GenoList.List.resize(snpMat.Num_Total_Samp);
-	for (int i=0; i < snpMat.Num_Total_Samp; i++)
-		_GenoList.List[i].BootstrapCount = _BootstrapCnt[i];
+	// swapping with empty containers to free the memory
+	vector<TGenotype>().swap(_GenoList.List);
 	_GenoList.Num_SNP = 0;
-
-	_Predict.InitPrediction(nHLA());
+	vector<THLAType>().swap(_PartHLA.List);
+	vector<UINT8>().swap(_PartGeno);
+	_NumInBag = 0;
+	_MemGeno.Set(0);
+
+	_NextHaplo.Parent = NULL;
+	vector<int>().swap(_NextHaplo.Start);
+	vector<double>().swap(_NextHaplo.Frequency);
+	vector<double>().swap(_NextHaplo.OldFreq);
+	CHaplotypeList Empty1, Empty2;
+	_NextReducedHaplo.Swap(Empty1);
+	_MinHaplo.Swap(Empty2);
+	_MemHaplo.Set(0);
+
+	vector<double>().swap(_HalvingFreq);
+	_MemHalving.Set(0);
 }
 
 void CVariableSelection::_InitHaplotype(CHaplotypeList &Haplo)
 {
 	vector<int> tmp(_HLAList->Num_HLA_Allele(), 0);
 	int SumCnt = 0;
-	for (int i=0; i < nSamp(); i++)
+	for (int i=0; i < _NumInBag; i++)
 	{
 		int cnt = _GenoList.List[i].BootstrapCount;
-		tmp[_HLAList->List[i].Allele1] += cnt;
-		tmp[_HLAList->List[i].Allele2] += cnt;
+		tmp[_PartHLA.List[i].Allele1] += cnt;
+		tmp[_PartHLA.List[i].Allele2] += cnt;
 		SumCnt += cnt;
 	}
 
@@ -1588,7 +2831,8 @@ void CVariableSelection::_InitHaplotype(CHaplotypeList &Haplo)
 	}
 }
 
-double CVariableSelection::_OutOfBagAccuracy(CHaplotypeList &Haplo)
+double CVariableSelection::_OutOfBagAccuracy(CHaplotypeList &Haplo,
+	int Stride)
 {
 #if (HIBAG_TIMING == 1)
 	_put_timing();
@@ -1597,17 +2841,23 @@ double CVariableSelection::_OutOfBagAccuracy(CHaplotypeList &Haplo)
 	HIBAG_CHECKING(Haplo.Num_SNP != _GenoList.Num_SNP,
 		"CVariableSelection::_OutOfBagAccuracy, Haplo and GenoList should have the same number of SNP markers.");
 
+	_Predict.CompilePlan(Haplo);
 	int TotalCnt=0, CorrectCnt=0;
-	vector<TGenotype>::const_iterator it   = _GenoList.List.begin();
-	vector<THLAType>::const_iterator  pHLA = _HLAList->List.begin();
+	vector<CAlg_EM::TSampGroup>::const_iterator it;
 
-	for (; it != _GenoList.List.end(); it++, pHLA++)
+	// predict once for each group of identical out-of-bag samples
+	const int n = _EM._OutOfBagGroup.size();
+	for (int i=0; i < n; i += Stride)
 	{
-		if (it->BootstrapCount <= 0)
+		it = _EM._OutOfBagGroup.begin() + i;
+		for (int c=0; c < 4; c++)
 		{
-			CorrectCnt += CHLATypeList::Compare(
-				_Predict._PredBestGuess(Haplo, *it), *pHLA);
-			TotalCnt += 2;
+			const int cnt = it->ClassCount[c];
+			if (cnt <= 0) continue;
+			const int k = it->ClassSamp[c];
+			CorrectCnt += cnt * CHLATypeList::Compare(
+				_Predict._PredBestGuess(_GenoList.List[k]), _PartHLA.List[k]);
+			TotalCnt += 2*cnt;
 		}
 	}
 
@@ -1618,7 +2868,8 @@ double CVariableSelection::_OutOfBagAccuracy(CHaplotypeList &Haplo)
 	return (TotalCnt>0) ? double(CorrectCnt)/TotalCnt : 1;
 }
 
-double CVariableSelection::_InBagLogLik(CHaplotypeList &Haplo)
+double CVariableSelection::_InBagLogLik(CHaplotypeList &Haplo,
+	bool Compiled)
 {
 #if (HIBAG_TIMING == 1)
 	_put_timing();
@@ -1627,16 +2878,20 @@ double CVariableSelection::_InBagLogLik(CHaplotypeList &Haplo)
 	HIBAG_CHECKING(Haplo.Num_SNP != _GenoList.Num_SNP,
 		"CVariableSelection::_InBagLogLik, Haplo and GenoList should have the same number of SNP markers.");
 
-	vector<TGenotype>::const_iterator it   = _GenoList.List.begin();
-	vector<THLAType>::const_iterator  pHLA = _HLAList->List.begin();
+	if (!Compiled) _Predict.CompilePlan(Haplo);
+	vector<CAlg_EM::THaploPairList>::const_iterator it;
 	double LogLik = 0;
 
-	for (; it != _GenoList.List.end(); it++, pHLA++)
+	// evaluate once for each group of identical in-bag samples
+	for (it = _EM._SampHaploPair.begin(); it != _EM._SampHaploPair.end(); it++)
 	{
-		if (it->BootstrapCount > 0)
+		for (int c=0; c < 4; c++)
 		{
-			LogLik += it->BootstrapCount *
-				log(_Predict._PredPostProb(Haplo, *it, *pHLA));
+			const int cnt = it->ClassCount[c];
+			if (cnt <= 0) continue;
+			const int k = it->ClassSamp[c];
+			LogLik += cnt *
+				log(_Predict._PredPostProb(_GenoList.List[k], _PartHLA.List[k]));
 		}
 	}
 
@@ -1646,10 +2901,126 @@ double CVariableSelection::_InBagLogLik(CHaplotypeList &Haplo)
 	return -2 * LogLik;
 }
 
-void CVariableSelection::Search(CBaseSampling &VarSampling,
+/// a candidate in successive halving
+struct TCandHalving
+{
+	int Idx;                   //< the index in the selection
+	int Slot;                  //< the slot of saved haplotype frequencies
+	CAlg_EM::TEMState State;   //< the state of EM algorithm
+	double Acc;                //< the out-of-bag accuracy on a subsample
+
+	bool operator< (const TCandHalving &y) const
+	{
+		if (Acc != y.Acc) return (Acc > y.Acc);
+		if (State.LogLik != y.State.LogLik) return (State.LogLik > y.State.LogLik);
+		return (Idx < y.Idx);
+	}
+};
+
+void CVariableSelection::_SuccessiveHalving(CSamplingWithoutReplace &VarSampling,
+	vector<bool> &Evaluate, double RareProb, CAlg_EM::TEMState &OutState,
+	TSearchTrace *Trace)
+{
+	OutState = CAlg_EM::TEMState();
+	vector<TCandHalving> Cand;
+	for (int i=0; i < (int)Evaluate.size(); i++)
+	{
+		if (Evaluate[i])
+		{
+			Cand.push_back(TCandHalving());
+			Cand.back().Idx = i;
+			Cand.back().Slot = Cand.size() - 1;
+			Cand.back().Acc = 0;
+		}
+	}
+	if (Cand.size() <= 2) return;
+
+	// the number of rounds
+	int n_round = 0;
+	while ((1 << n_round) < (int)Cand.size()) n_round ++;
+	const int n_oob = _EM._OutOfBagGroup.size();
+	double tm = Trace ? WallClock() : 0;
+
+	// the saved frequencies of doubled haplotypes for each candidate
+	const size_t n_freq = _NextHaplo.TotalNumOfHaplo();
+	_HalvingFreq.resize(Cand.size() * n_freq);
+	_MemHalving.Set(_HalvingFreq.capacity() * sizeof(double));
+
+	int MaxIter = HALVING_EM_ITER;
+	for (int r=0; Cand.size() > 1; r++)
+	{
+		// evaluate on every 'stride'-th out-of-bag group
+		int stride = (r < n_round) ? (1 << (n_round - r)) : 1;
+		stride = std::max(1, std::min(stride, n_oob / HALVING_MIN_OOB_GROUP));
+
+		vector<TCandHalving>::iterator p;
+		for (p = Cand.begin(); p != Cand.end(); )
+		{
+			const UINT8 *pGeno = _SNPGeno(VarSampling[p->Idx]);
+			double *pFreq = &_HalvingFreq[p->Slot * n_freq];
+			if (r == 0)
+			{
+				if (!_EM.PrepareNewSNP(pGeno, _GenoList, _NextHaplo))
+				{
+					p = Cand.erase(p);
+					continue;
+				}
+			} else {
+				_EM.PrepareNewSNP(pGeno, _GenoList, _NextHaplo, false);
+				std::copy(pFreq, pFreq + n_freq, _NextHaplo.Frequency.begin());
+			}
+
+			// continue EM iterations
+			const int n_iter = p->State.Iter;
+			_EM.ExpectationMaximization(_NextHaplo, p->State, MaxIter);
+			std::copy(_NextHaplo.Frequency.begin(), _NextHaplo.Frequency.end(), pFreq);
+			_NextHaplo.EraseDoubleHaplos(RareProb, _NextReducedHaplo);
+			if (Trace)
+			{
+				double t = WallClock();
+				Trace->TimeEM += t - tm; tm = t;
+				Trace->SumEMIter += p->State.Iter - n_iter;
+			}
+
+			_GenoList.AddSNP(pGeno);
+			p->Acc = _OutOfBagAccuracy(_NextReducedHaplo, stride);
+			_GenoList.ReduceSNP();
+			if (Trace)
+			{
+				double t = WallClock();
+				Trace->TimeOutOfBag += t - tm; tm = t;
+			}
+			p++;
+		}
+
+		// keep the better half
+		if (Cand.size() > 1)
+		{
+			std::sort(Cand.begin(), Cand.end());
+			Cand.resize((Cand.size() + 1) / 2);
+		}
+		MaxIter *= 2;
+	}
+
+	Evaluate.assign(Evaluate.size(), false);
+	if (!Cand.empty())
+	{
+		// the winner is resumed from its state in the exact evaluation
+		Evaluate[Cand[0].Idx] = true;
+		OutState = Cand[0].State;
+		if (Cand[0].Slot > 0)
+		{
+			const double *pFreq = &_HalvingFreq[Cand[0].Slot * n_freq];
+			std::copy(pFreq, pFreq + n_freq, _HalvingFreq.begin());
+		}
+	}
+}
+
+void CVariableSelection::Search(CSamplingWithoutReplace &VarSampling,
 	CHaplotypeList &OutHaplo, vector<int> &OutSNPIndex,
 	double &Out_Global_Max_OutOfBagAcc, int mtry, bool prune,
-	bool verbose, bool verbose_detail)
+	bool verbose, bool verbose_detail, vector<TSearchTrace> *OutTrace,
+	int IdxClassifier)
 {
 	// rare probability
 	const double RARE_PROB = std::max(FRACTION_HAPLO/(2*nSamp()), MIN_RARE_FREQ);
@@ -1662,13 +3033,40 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 	double Global_Max_OutOfBagAcc = 0;
 	double Global_Min_Loss = 1e+30;
 
-	CHaplotypeList NextHaplo, NextReducedHaplo, MinHaplo;
+	// the working lists keep their storage, and the best candidate is
+	//   swapped in rather than copied
+	CDoubleHaploList &NextHaplo = _NextHaplo;
+	CHaplotypeList &NextReducedHaplo = _NextReducedHaplo;
+	CHaplotypeList &MinHaplo = _MinHaplo;
+	int Step = 0;
 
 	while ((VarSampling.TotalNum()>0) &&
 		(OutSNPIndex.size() < HIBAG_MAXNUM_SNP_IN_CLASSIFIER-1))  // reserve the last bit
 	{
+		TSearchTrace Trace;
+		double tm = 0;
+		if (OutTrace)
+		{
+			memset(&Trace, 0, sizeof(Trace));
+			Trace.Classifier = IdxClassifier;
+			Trace.Step = Step;
+			Trace.NumHaplo = OutHaplo.TotalNumOfHaplo();
+			tm = WallClock();
+		}
+		Step ++;
+
 		// prepare for growing the individual classifier
-		_EM.PrepareHaplotypes(OutHaplo, _GenoList, *_HLAList, NextHaplo);
+		_EM.PrepareHaplotypes(OutHaplo, _GenoList, _PartHLA, _NumInBag, NextHaplo);
+		_MemHaplo.Set(OutHaplo.MemBytes() + NextHaplo.MemBytes() +
+			NextReducedHaplo.MemBytes() + MinHaplo.MemBytes());
+
+		if (OutTrace)
+		{
+			double t = WallClock();
+			Trace.TimePrepare = t - tm; tm = t;
+			Trace.NumDoubleHaplo = NextHaplo.TotalNumOfHaplo();
+			Trace.NumPair = _EM.TotalNumOfPair();
+		}
 
 		double max_OutOfBagAcc = Global_Max_OutOfBagAcc;
 		double min_loss = Global_Min_Loss;
@@ -1676,22 +3074,97 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 
 		// sample mtry from all candidate SNP markers
 		VarSampling.RandomSelect(mtry);
+		if (OutTrace)
+			Trace.NumCandidate = VarSampling.NumOfSelection();
+
+		// screen the candidates, and only the most informative ones are
+		//   evaluated by EM in the original order
+		const int n_sel = VarSampling.NumOfSelection();
+		vector<bool> Evaluate(n_sel, true);
+		if ((_ScreenFrac < 1) && (n_sel > 1))
+		{
+			const int n_keep = std::max(1, (int)ceil(_ScreenFrac * n_sel));
+			if (n_keep < n_sel)
+			{
+				vector< pair<double, int> > Score(n_sel);
+				for (int i=0; i < n_sel; i++)
+				{
+					Score[i].first = _EM.ScreenEntropy(
+						_SNPGeno(VarSampling[i]), _GenoList);
+					Score[i].second = i;
+				}
+				std::nth_element(Score.begin(), Score.begin() + n_keep,
+					Score.end());
+				Evaluate.assign(n_sel, false);
+				for (int i=0; i < n_keep; i++)
+					Evaluate[Score[i].second] = true;
+			}
+		}
+
+		// successive halving leaves one candidate for the exact evaluation,
+		//   which continues the EM iterations of the winner
+		CAlg_EM::TEMState HalvingState;
+		if (_Halving)
+		{
+			_SuccessiveHalving(VarSampling, Evaluate, RARE_PROB, HalvingState,
+				OutTrace ? &Trace : NULL);
+			if (OutTrace) tm = WallClock();
+		}
+		const bool resume = (HalvingState.Iter > 0);
 
 		// for-loop
-		for (int i=0; i < VarSampling.NumOfSelection(); i++)
+		for (int i=0; i < n_sel; i++)
 		{
-			if (_EM.PrepareNewSNP(VarSampling[i], OutHaplo, *_SNPMat, _GenoList, NextHaplo))
+			if (!Evaluate[i]) continue;
+			if (_EM.PrepareNewSNP(_SNPGeno(VarSampling[i]), _GenoList, NextHaplo,
+				!resume))
 			{
-				// run EM algorithm
-				_EM.ExpectationMaximization(NextHaplo);
+				// run EM algorithm, and the iterations of successive halving
+				//   have been counted in the trace
+				int n_iter, n_total;
+				if (resume)
+				{
+					std::copy(_HalvingFreq.begin(),
+						_HalvingFreq.begin() + NextHaplo.Frequency.size(),
+						NextHaplo.Frequency.begin());
+					const int n_done = HalvingState.Iter;
+					n_total = _EM.ExpectationMaximization(NextHaplo,
+						HalvingState, INT_MAX);
+					n_iter = n_total - n_done;
+				} else
+					n_iter = n_total = _EM.ExpectationMaximization(NextHaplo);
 				NextHaplo.EraseDoubleHaplos(RARE_PROB, NextReducedHaplo);
+				_MemHaplo.Set(OutHaplo.MemBytes() + NextHaplo.MemBytes() +
+					NextReducedHaplo.MemBytes() + MinHaplo.MemBytes());
+
+				if (OutTrace)
+				{
+					double t = WallClock();
+					Trace.TimeEM += t - tm; tm = t;
+					Trace.NumEvaluated ++;
+					Trace.SumEMIter += n_iter;
+					if (n_total > Trace.MaxEMIter) Trace.MaxEMIter = n_total;
+					Trace.SumReducedHaplo += NextReducedHaplo.TotalNumOfHaplo();
+				}
 
 				// evaluate losses
-				_GenoList.AddSNP(VarSampling[i], *_SNPMat);
+				_GenoList.AddSNP(_SNPGeno(VarSampling[i]));
 				double loss = 0;
 				double acc = _OutOfBagAccuracy(NextReducedHaplo);
+				if (OutTrace)
+				{
+					double t = WallClock();
+					Trace.TimeOutOfBag += t - tm; tm = t;
+				}
 				if (acc >= max_OutOfBagAcc)
-					loss = _InBagLogLik(NextReducedHaplo);
+				{
+					loss = _InBagLogLik(NextReducedHaplo, true);
+					if (OutTrace)
+					{
+						double t = WallClock();
+						Trace.TimeInBag += t - tm; tm = t;
+					}
+				}
 				_GenoList.ReduceSNP();
 
 				// compare
@@ -1699,14 +3172,14 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 				{
 					min_i = i;
 					min_loss = loss; max_OutOfBagAcc = acc;
-					MinHaplo = NextReducedHaplo;
+					MinHaplo.Swap(NextReducedHaplo);
 				} else if (acc == max_OutOfBagAcc)
 				{
 					if (loss < min_loss)
 					{
 						min_i = i;
 						min_loss = loss;
-						MinHaplo = NextReducedHaplo;
+						MinHaplo.Swap(NextReducedHaplo);
 					}
 				}
 				// check and delete
@@ -1720,7 +3193,13 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 						if ((loss > Global_Min_Loss*(1+PRUNE_RELTOL_LOGLIK)) && (min_i != i))
 							VarSampling[i] = -1;
 					}
+					if (OutTrace && (VarSampling[i] < 0))
+						Trace.NumPruned ++;
 				}
+			} else if (OutTrace)
+			{
+				double t = WallClock();
+				Trace.TimeEM += t - tm; tm = t;
 			}
 		}
 
@@ -1746,9 +3225,9 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 			// add a new SNP predictor
 			Global_Max_OutOfBagAcc = max_OutOfBagAcc;
 			Global_Min_Loss = min_loss;
-			OutHaplo = MinHaplo;
+			OutHaplo.Swap(MinHaplo);
 			OutSNPIndex.push_back(VarSampling[min_i]);
-			_GenoList.AddSNP(VarSampling[min_i], *_SNPMat);
+			_GenoList.AddSNP(_SNPGeno(VarSampling[min_i]));
 			if (prune)
 			{
 				VarSampling[min_i] = -1;
@@ -1767,17 +3246,58 @@ void CVariableSelection::Search(CBaseSampling &VarSampling,
 			// only keep "n_tmp - m" predictors
 			VarSampling.RemoveSelection();
 		}
+
+		if (OutTrace)
+		{
+			Trace.NewSNP = sign ? OutSNPIndex.back() : -1;
+			Trace.OutOfBagAcc = Global_Max_OutOfBagAcc;
+			Trace.Loss = Global_Min_Loss;
+			OutTrace->push_back(Trace);
+		}
 	}
-	
+
+	// a compact copy for the classifier, and the spare storage is kept
+	CHaplotypeList tmp(OutHaplo);
+	OutHaplo.Swap(tmp);
+	MinHaplo.Swap(tmp);
+	_MemHaplo.Set(NextHaplo.MemBytes() + NextReducedHaplo.MemBytes() +
+		MinHaplo.MemBytes());
+
 	Out_Global_Max_OutOfBagAcc = Global_Max_OutOfBagAcc;
 }
 
+void CVariableSelection::AddOutOfBagProb(const CHaplotypeList &Haplo,
+	const int BootstrapCnt[], const double SampWeight[], double OutSumProb[])
+{
+	HIBAG_CHECKING(Haplo.Num_SNP != _GenoList.Num_SNP,
+		"CVariableSelection::AddOutOfBagProb, Haplo and GenoList should have the same number of SNP markers.");
+
+	_Predict.CompilePlan(Haplo);
+	const int n_pair = _Predict._nPairHLA;
+
+	// the out-of-bag samples follow the in-bag samples in '_GenoList',
+	//   in the original order
+	int k = _NumInBag;
+	for (int i=0; i < nSamp(); i++)
+	{
+		if (BootstrapCnt[i] > 0) continue;
+		const TGenotype &G = _GenoList.List[k++];
+		const double w = SampWeight[i];
+		if (w <= 0) continue;
+		_Predict.PredictPostProb(G);
+		double *p = OutSumProb + (size_t)i * n_pair;
+		const double *s = &_Predict._PostProb[0];
+		for (int j=0; j < n_pair; j++) p[j] += s[j] * w;
+	}
+}
+
 
 
 // -------------------------------------------------------------------------
 // The individual classifier
 
-CAttrBag_Classifier::CAttrBag_Classifier(CAttrBag_Model &_owner)
+CAttrBag_Classifier::CAttrBag_Classifier(CAttrBag_Model &_owner):
+	_MemBootstrap(MEM_GENOTYPE), _MemHaplo(MEM_HAPLOTYPE), _Plan(MEM_HAPLOTYPE)
 {
 	_Owner = &_owner;
 	_OutOfBag_Accuracy = 0;
@@ -1785,8 +3305,10 @@ CAttrBag_Classifier::CAttrBag_Classifier(CAttrBag_Model &_owner)
 
 void CAttrBag_Classifier::InitBootstrapCount(int SampCnt[])
 {
+	_MemBootstrap.Set(_Owner->nSamp() * sizeof(int));
 	_BootstrapCount.assign(&SampCnt[0], &SampCnt[_Owner->nSamp()]);
 	_Haplo.List.clear();
+	_MemHaplo.Set(_Haplo.MemBytes());
 	_SNPIndex.clear();
 	_OutOfBag_Accuracy = 0;
 }
@@ -1801,6 +3323,7 @@ void CAttrBag_Classifier::Assign(int n_snp, const int snpidx[],
 	if (samp_num)
 	{
 		const int n = _Owner->nSamp();
+		_MemBootstrap.Set(n * sizeof(int));
 		_BootstrapCount.assign(&samp_num[0], &samp_num[n]);
 	}
 	// The haplotypes
@@ -1811,24 +3334,71 @@ void CAttrBag_Classifier::Assign(int n_snp, const int snpidx[],
 	{
 		_Haplo.List[hla[i]].push_back(THaplotype(haplo[i], freq[i]));
 	}
+	_MemHaplo.Set(_Haplo.MemBytes());
+	_Plan.Clear();
 	// Accuracies
 	_OutOfBag_Accuracy = (_acc) ? (*_acc) : 0;
 }
 
-void CAttrBag_Classifier::Grow(CBaseSampling &VarSampling, int mtry,
-	bool prune, bool verbose, bool verbose_detail)
+void CAttrBag_Classifier::Grow(CSamplingWithoutReplace &VarSampling, int mtry,
+	bool prune, bool verbose, bool verbose_detail,
+	vector<TSearchTrace> *OutTrace, int IdxClassifier)
 {
 	_Owner->_VarSelect.InitSelection(_Owner->_SNPMat,
 		_Owner->_HLAList, &_BootstrapCount[0]);
 	_Owner->_VarSelect.Search(VarSampling, _Haplo, _SNPIndex,
-		_OutOfBag_Accuracy, mtry, prune, verbose, verbose_detail);
+		_OutOfBag_Accuracy, mtry, prune, verbose, verbose_detail,
+		OutTrace, IdxClassifier);
+	_MemHaplo.Set(_Haplo.MemBytes());
+	_Plan.Clear();
 }
 
 
 // -------------------------------------------------------------------------
 // the attribute bagging model
 
-CAttrBag_Model::CAttrBag_Model() { }
+CAttrBag_Model::CAttrBag_Model():
+	_MemHLA(MEM_GENOTYPE), _MemTrace(MEM_OUTPUT)
+{
+	_EarlyExitTol = 0;
+	_PredNumWord = 0;
+	_StopTol = _StopMaxTime = 0;
+}
+
+void CAttrBag_Model::SetEarlyExit(double tol)
+{
+	if (!R_finite(tol) || (tol < 0))
+		throw ErrHLA("Invalid tolerance of the early exit.");
+	_EarlyExitTol = tol;
+}
+
+void CAttrBag_Model::SetEnsembleStop(double tol, double max_time)
+{
+	if (!R_finite(tol) || (tol < 0))
+		throw ErrHLA("Invalid tolerance of the ensemble out-of-bag accuracy.");
+	if (ISNAN(max_time) || (max_time < 0))
+		throw ErrHLA("Invalid time limit of training.");
+	_StopTol = tol;
+	_StopMaxTime = R_finite(max_time) ? max_time : 0;
+}
+
+void CAttrBag_Model::SetSNPWeight(const double weight[])
+{
+	if (weight)
+	{
+		bool any_pos = false;
+		for (int i=0; i < nSNP(); i++)
+		{
+			if (!R_finite(weight[i]) || (weight[i] < 0))
+				throw ErrHLA("The sampling weights of SNPs should be non-negative.");
+			if (weight[i] > 0) any_pos = true;
+		}
+		if (!any_pos)
+			throw ErrHLA("At least one sampling weight of SNPs should be positive.");
+		_SNPSampWeight.assign(weight, weight + nSNP());
+	} else
+		_SNPSampWeight.clear();
+}
 
 void CAttrBag_Model::InitTraining(int n_snp, int n_samp, int n_hla)
 {
@@ -1840,6 +3410,7 @@ void CAttrBag_Model::InitTraining(int n_snp, int n_samp, int n_hla)
 	_SNPMat.Num_Total_SNP = n_snp;
 	_SNPMat.pGeno = NULL;
 
+	_MemHLA.Set(n_samp * sizeof(THLAType));
 	_HLAList.List.resize(n_samp);
 	_HLAList.Str_HLA_Allele.resize(n_hla);
 }
@@ -1855,6 +3426,7 @@ void CAttrBag_Model::InitTraining(int n_snp, int n_samp, int *snp_geno,
 	_SNPMat.Num_Total_SNP = n_snp;
 	_SNPMat.pGeno = snp_geno;
 
+	_MemHLA.Set(n_samp * sizeof(THLAType));
 	_HLAList.List.resize(n_samp);
 	_HLAList.Str_HLA_Allele.resize(n_hla);
 	for (int i=0; i < n_samp; i++)
@@ -1907,7 +3479,7 @@ CAttrBag_Classifier *CAttrBag_Model::NewClassifierAllSamp()
 }
 
 void CAttrBag_Model::BuildClassifiers(int nclassifier, int mtry, bool prune,
-	bool verbose, bool verbose_detail)
+	bool verbose, bool verbose_detail, bool trace)
 {
 #if (HIBAG_TIMING > 0)
 	_timing_ = 0;
@@ -1915,24 +3487,170 @@ void CAttrBag_Model::BuildClassifiers(int nclassifier, int mtry, bool prune,
 #endif
 
 	CSamplingWithoutReplace VarSampling;
+	VarSampling.SetWeight(_SNPSampWeight.empty() ? NULL : &_SNPSampWeight[0],
+		_SNPSampWeight.size());
+
+	// the running ensemble out-of-bag estimate: the sums of posterior
+	//   probabilities over the classifiers, for which a sample is out of bag
+	const int n_pair = nHLA()*(nHLA()+1)/2;
+	vector<double> SumProb, SampWeight;
+	vector<int> OOBCorrect, OOBCount, OOBValid, SNPWeight;
+	vector<double> SEList;
+	CdMemUsage MemEnsemble(MEM_SCRATCH);
+	_EnsembleAcc.clear();
+	if (_StopTol > 0)
+	{
+		// rejected before training if exceeding the memory budget
+		const size_t Bytes = size_t(nSamp())*(n_pair+1)*sizeof(double) +
+			size_t(nSamp())*3*sizeof(int) + size_t(nSNP())*sizeof(int);
+		MemEnsemble.Set(Bytes);
+		SumProb.assign(size_t(nSamp())*n_pair, 0);
+		SampWeight.assign(nSamp(), 0);
+		OOBCorrect.assign(nSamp(), 0);
+		OOBCount.assign(nSamp(), 0);
+		OOBValid.assign(nSamp(), 0);
+		SNPWeight.assign(nSNP(), 0);
+	}
+	int NumOOB=0, NumCovered=0, SumCorrect=0;
+	// the first classifier index, after which every sample has been out of bag
+	int KFull = -1;
+	const double StartTime = WallClock();
+
+	// no reallocation of the classifier list during training, which would
+	//   copy the classifiers and charge their memory usage twice
+	_ClassifierList.reserve(_ClassifierList.size() + nclassifier);
+
+	_Progress.Info = "Training:";
+	_Progress.Unit = "classifiers";
+	_Progress.RatePerHour = true;
+	_Progress.Init(nclassifier, false);
 
 	for (int k=0; k < nclassifier; k++)
 	{
 		VarSampling.Init(nSNP());
 
 		CAttrBag_Classifier *I = NewClassifierBootstrap();
-		I->Grow(VarSampling, mtry, prune, verbose, verbose_detail);
+		I->Grow(VarSampling, mtry, prune, verbose, verbose_detail,
+			trace ? &_Trace : NULL, _ClassifierList.size() - 1);
+		_MemTrace.Set(_Trace.capacity() * sizeof(TSearchTrace));
+
+		double EnsAcc=0, EnsSE=0;
+		if (_StopTol > 0)
+		{
+			const int *pCnt = &I->_BootstrapCount[0];
+			// the same weights of missing SNPs as in prediction, and no
+			//   prediction if all SNPs of the classifier are missing; the
+			//   SNP weights (the numbers of classifiers using each SNP)
+			//   adapt as classifiers are added, and the posteriors added
+			//   by earlier classifiers are not reweighted
+			_GetSNPWeights(&SNPWeight[0]);
+			const int n = I->nSNP();
+			int SumWeight = 0;
+			for (int j=0; j < n; j++)
+				SumWeight += SNPWeight[I->_SNPIndex[j]];
+			for (int i=0; i < nSamp(); i++)
+			{
+				SampWeight[i] = 0;
+				if (pCnt[i] > 0) continue;
+				int nWeight = 0;
+				for (int j=0; j < n; j++)
+				{
+					const int v = _SNPMat.Get(i, I->_SNPIndex[j]);
+					if ((0 <= v) && (v <= 2))
+						nWeight += SNPWeight[I->_SNPIndex[j]];
+				}
+				if (SumWeight > 0)
+					SampWeight[i] = double(nWeight) / SumWeight;
+			}
+			_VarSelect.AddOutOfBagProb(I->_Haplo, pCnt, &SampWeight[0],
+				&SumProb[0]);
+			// update the best guesses of the out-of-bag samples
+			for (int i=0; i < nSamp(); i++)
+			{
+				if (pCnt[i] > 0) continue;
+				if (OOBCount[i]++ == 0) NumOOB ++;
+				if (SampWeight[i] <= 0) continue;
+				const double *p = &SumProb[(size_t)i * n_pair];
+				THLAType G;
+				G.Allele1 = G.Allele2 = NA_INTEGER;
+				double max = 0;
+				for (int h1=0; h1 < nHLA(); h1++)
+				{
+					for (int h2=h1; h2 < nHLA(); h2++, p++)
+					{
+						if (max < *p)
+							{ max = *p; G.Allele1 = h1; G.Allele2 = h2; }
+					}
+				}
+				if (OOBValid[i]++ == 0) NumCovered ++;
+				SumCorrect -= OOBCorrect[i];
+				OOBCorrect[i] = CHLATypeList::Compare(G, _HLAList.List[i]);
+				SumCorrect += OOBCorrect[i];
+			}
+			if (NumCovered > 0)
+			{
+				EnsAcc = double(SumCorrect) / (2*NumCovered);
+				EnsSE = sqrt(EnsAcc * (1 - EnsAcc) / (2*NumCovered));
+			}
+			_EnsembleAcc.push_back(EnsAcc);
+			SEList.push_back(EnsSE);
+			if ((KFull < 0) && (NumOOB >= nSamp())) KFull = k;
+		}
+
+		_Progress.Forward(1, true);
 		if (verbose)
 		{
 			time_t tm; time(&tm);
 			string s(ctime(&tm));
 			s.erase(s.size()-1, 1);
 			Rprintf(
-				"[%d] %s, OOB Acc: %0.2f%%, # of SNPs: %d, # of Haplo: %d\n",
-				k+1, s.c_str(), I->OutOfBag_Accuracy()*100, I->nSNP(), I->nHaplo());
+				"[%d] %s, OOB Acc: %0.2f%%, # of SNPs: %d, # of Haplo: %d %s\n",
+				k+1, s.c_str(), I->OutOfBag_Accuracy()*100, I->nSNP(), I->nHaplo(),
+				_Progress.RateETAStr().c_str());
+			if (_StopTol > 0)
+			{
+				Rprintf("    ensemble OOB Acc: %0.2f%%, SE: %0.2f%%\n",
+					EnsAcc*100, EnsSE*100);
+			}
+		}
+
+		// the stopping rules of the adaptive ensemble size, the window only
+		//   includes the estimates over all samples
+		if ((k+1 < nclassifier) && (_StopTol > 0) && (KFull >= 0) &&
+			(k+1 - KFull >= ENSEMBLE_STOP_WINDOW))
+		{
+			const int st = k + 1 - ENSEMBLE_STOP_WINDOW;
+			double MinAcc = _EnsembleAcc[st], MaxAcc = MinAcc;
+			double MinSE = SEList[st], MaxSE = MinSE;
+			for (int j=st+1; j <= k; j++)
+			{
+				MinAcc = std::min(MinAcc, _EnsembleAcc[j]);
+				MaxAcc = std::max(MaxAcc, _EnsembleAcc[j]);
+				MinSE = std::min(MinSE, SEList[j]);
+				MaxSE = std::max(MaxSE, SEList[j]);
+			}
+			if ((MaxAcc - MinAcc <= _StopTol) && (MaxSE - MinSE <= _StopTol))
+			{
+				if (verbose)
+				{
+					Rprintf("The ensemble out-of-bag accuracy converges with %d classifiers.\n",
+						k+1);
+				}
+				break;
+			}
+		}
+		if ((k+1 < nclassifier) && (_StopMaxTime > 0) &&
+			(WallClock() - StartTime >= _StopMaxTime))
+		{
+			if (verbose)
+				Rprintf("The time limit of training is reached with %d classifiers.\n", k+1);
+			break;
 		}
 	}
 
+	// the training genotypes and working buffers are not used in prediction
+	_VarSelect.DoneSelection();
+
 #if (HIBAG_TIMING > 0)
 	Rprintf("It took %0.2f seconds, in %0.2f%%.\n",
 		((double)_timing_)/CLOCKS_PER_SEC,
@@ -1942,39 +3660,57 @@ void CAttrBag_Model::BuildClassifiers(int nclassifier, int mtry, bool prune,
 
 void CAttrBag_Model::PredictHLA(const int *genomat, int n_samp, int vote_method,
 	int OutH1[], int OutH2[], double OutMaxProb[],
-	double OutProbArray[], bool ShowInfo)
+	double OutProbArray[], double OutErrBound[], int OutNumClassifier[],
+	bool ShowInfo)
 {
 	if ((vote_method < 1) || (vote_method > 2))
 		throw ErrHLA("Invalid 'vote_method'.");
 
 	const int nPairHLA = nHLA()*(nHLA()+1)/2;
+	int NumCls[HIBAG_PREDICT_BLOCK_SIZE];
 
 	_Predict.InitPrediction(nHLA());
-	Progress.Info = "Predicting:";
-	Progress.Init(n_samp, ShowInfo);
+	_Predict.InitBlockBuffer();
+	_Progress.Info = "Predicting:";
+	_Progress.Unit = "samples";
+	_Progress.RatePerHour = false;
+	_Progress.Init(n_samp, ShowInfo);
 
 	vector<int> Weight(nSNP());
 	_GetSNPWeights(&Weight[0]);
+	_InitPredMask(&Weight[0]);
 
-	for (int i=0; i < n_samp; i++, genomat+=nSNP())
+	for (int st=0; st < n_samp; st += HIBAG_PREDICT_BLOCK_SIZE)
 	{
-		_PredictHLA(genomat, &Weight[0], vote_method);
+		const int n = std::min(HIBAG_PREDICT_BLOCK_SIZE, n_samp - st);
+		_PredictHLABlock(genomat + (size_t)st*nSNP(), n, &Weight[0],
+			vote_method, NumCls);
 
-		THLAType HLA = _Predict.BestGuessEnsemble();
-		OutH1[i] = HLA.Allele1; OutH2[i] = HLA.Allele2;
+		for (int k=0; k < n; k++)
+		{
+			const int i = st + k;
+			const double *pSum = _Predict.SumPostProbBlock(k);
+			THLAType HLA = _Predict.BestGuessEnsembleBlock(k);
+			OutH1[i] = HLA.Allele1; OutH2[i] = HLA.Allele2;
 
-		if ((HLA.Allele1 != NA_INTEGER) && (HLA.Allele2 != NA_INTEGER))
-			OutMaxProb[i] = _Predict.IndexSumPostProb(HLA.Allele1, HLA.Allele2);
-		else
-			OutMaxProb[i] = 0;
+			if ((HLA.Allele1 != NA_INTEGER) && (HLA.Allele2 != NA_INTEGER))
+				OutMaxProb[i] = pSum[_Predict.IndexPair(HLA.Allele1, HLA.Allele2)];
+			else
+				OutMaxProb[i] = 0;
 
-		if (OutProbArray)
-		{
-			for (int j=0; j < nPairHLA; j++)
-				*OutProbArray++ = _Predict.SumPostProb()[j];
+			if (OutProbArray)
+			{
+				double *p = OutProbArray + (size_t)i*nPairHLA;
+				for (int j=0; j < nPairHLA; j++)
+					p[j] = pSum[j];
+			}
+			if (OutErrBound)
+				OutErrBound[i] = _Predict.SumErrBoundBlock(k);
+			if (OutNumClassifier)
+				OutNumClassifier[i] = NumCls[k];
 		}
 
-		Progress.Forward(1, ShowInfo);
+		_Progress.Forward(n, ShowInfo);
 	}
 }
 
@@ -1985,69 +3721,407 @@ void CAttrBag_Model::PredictHLA_Prob(const int *genomat, int n_samp,
 		throw ErrHLA("Invalid 'vote_method'.");
 
 	const int n = nHLA()*(nHLA()+1)/2;
+	int NumCls[HIBAG_PREDICT_BLOCK_SIZE];
 	_Predict.InitPrediction(nHLA());
-	Progress.Info = "Predicting:";
-	Progress.Init(n_samp, ShowInfo);
+	_Predict.InitBlockBuffer();
+	_Progress.Info = "Predicting:";
+	_Progress.Unit = "samples";
+	_Progress.RatePerHour = false;
+	_Progress.Init(n_samp, ShowInfo);
 
 	vector<int> Weight(nSNP());
 	_GetSNPWeights(&Weight[0]);
+	_InitPredMask(&Weight[0]);
+
+	for (int st=0; st < n_samp; st += HIBAG_PREDICT_BLOCK_SIZE)
+	{
+		const int m = std::min(HIBAG_PREDICT_BLOCK_SIZE, n_samp - st);
+		_PredictHLABlock(genomat + (size_t)st*nSNP(), m, &Weight[0],
+			vote_method, NumCls);
+		for (int k=0; k < m; k++)
+		{
+			const double *pSum = _Predict.SumPostProbBlock(k);
+			double *p = OutProb + (size_t)(st + k)*n;
+			for (int j=0; j < n; j++)
+				p[j] = pSum[j];
+		}
+		_Progress.Forward(m, ShowInfo);
+	}
+}
+
+void CAttrBag_Model::PredictOutOfBag(const int *genomat, int OutH1[],
+	int OutH2[], double OutProb[], int nThread, bool ShowInfo)
+{
+	const int n_cls = _ClassifierList.size();
+	if (nThread < 1) nThread = 1;
+	for (int c=0; c < n_cls; c++)
+	{
+		if ((int)_ClassifierList[c]._BootstrapCount.size() != nSamp())
+			throw ErrHLA("There is no bootstrap sample index.");
+	}
+	for (size_t k=0; k < size_t(nSamp())*n_cls; k++)
+	{
+		OutH1[k] = OutH2[k] = NA_INTEGER;
+		OutProb[k] = 0;
+	}
+
+	_Progress.Info = "Out-of-bag:";
+	_Progress.Unit = "classifiers";
+	_Progress.RatePerHour = false;
+	_Progress.Init(n_cls, ShowInfo);
+
+	// the classifiers are independent, and each thread has its own
+	//   prediction object; exceptions are passed to the calling thread
+	string ErrMsg;
+#ifdef _OPENMP
+	#pragma omp parallel num_threads(nThread)
+#endif
+	{
+		CAlg_Prediction Pred;
+		TGenotype Geno;
+		bool failed = false;
+		try {
+			Pred.InitPrediction(nHLA());
+		} catch (exception &E) {
+			failed = true;
+		#ifdef _OPENMP
+			#pragma omp critical(HIBAG_OutOfBag)
+		#endif
+			ErrMsg = E.what();
+		}
+
+	#ifdef _OPENMP
+		#pragma omp for schedule(dynamic)
+	#endif
+		for (int c=0; c < n_cls; c++)
+		{
+			if (failed) continue;
+			try {
+				const CAttrBag_Classifier &C = _ClassifierList[c];
+				const int n = C.nSNP();
+				Pred.CompilePlan(C._Haplo);
+				for (int i=0; i < nSamp(); i++)
+				{
+					if (C._BootstrapCount[i] > 0) continue;
+					// no prediction if all SNPs are missing
+					const int *g = genomat + (size_t)i*nSNP();
+					bool valid = false;
+					for (int j=0; (j < n) && !valid; j++)
+					{
+						const int v = g[C._SNPIndex[j]];
+						valid = ((0 <= v) && (v <= 2));
+					}
+					if (!valid) continue;
+
+					Geno.IntToSNP(n, g, &C._SNPIndex[0]);
+					Pred.PredictPostProb(Geno);
+					THLAType HLA = Pred.BestGuess();
+					const size_t k = (size_t)c*nSamp() + i;
+					OutH1[k] = HLA.Allele1; OutH2[k] = HLA.Allele2;
+					if ((HLA.Allele1 != NA_INTEGER) && (HLA.Allele2 != NA_INTEGER))
+						OutProb[k] = Pred.IndexPostProb(HLA.Allele1, HLA.Allele2);
+				}
+			} catch (exception &E) {
+				failed = true;
+			#ifdef _OPENMP
+				#pragma omp critical(HIBAG_OutOfBag)
+			#endif
+				ErrMsg = E.what();
+			}
+			// only counting in the parallel region
+			_Progress.Forward(1, ShowInfo);
+		}
+	}
+
+	// report the completion from the calling thread
+	_Progress.Forward(0, ShowInfo);
+
+	if (!ErrMsg.empty())
+		throw ErrHLA(ErrMsg);
+}
+
+/// parallel bits extract: gather the bits of 'x' selected by 'mask' into
+//    the low-order bits
+static inline uint64_t PEXT_U64(uint64_t x, uint64_t mask)
+{
+#if defined(HIBAG_HARDWARE_PEXT) && !defined(HIBAG_DISPATCH_PEXT)
+	return _pext_u64(x, mask);
+#else
+	uint64_t rv = 0, bit = 1;
+	for (; mask; mask &= mask - 1, bit <<= 1)
+	{
+		if (x & mask & (~mask + 1)) rv |= bit;
+	}
+	return rv;
+#endif
+}
+
+/// append the extracted bits 'v' to 'S' at the bit position 'pos'
+static inline void _AppendBits(uint64_t S[], int pos, uint64_t v)
+{
+	const int sh = pos & 0x3F, iw = pos >> 6;
+	S[iw] |= v << sh;
+	if (sh > 0) S[iw+1] |= v >> (64 - sh);
+}
+
+/// the function type of gathering the bits of a classifier from the planes
+//    of a sample, in the order of SNP indices
+typedef void (*TGatherBitsFunc)(int nM, const int Word[],
+	const uint64_t Mask[], const uint64_t *p1, const uint64_t *p2,
+	const uint64_t *pV, uint64_t S1[], uint64_t S2[], uint64_t SV[]);
+
+static void _GatherBits(int nM, const int Word[], const uint64_t Mask[],
+	const uint64_t *p1, const uint64_t *p2, const uint64_t *pV,
+	uint64_t S1[], uint64_t S2[], uint64_t SV[])
+{
+	int pos = 0;
+	for (int i=0; i < nM; i++)
+	{
+		const int w = Word[i];
+		const uint64_t m = Mask[i];
+		_AppendBits(S1, pos, PEXT_U64(p1[w], m));
+		_AppendBits(S2, pos, PEXT_U64(p2[w], m));
+		_AppendBits(SV, pos, PEXT_U64(pV[w], m));
+		pos += POPCNT_U64(m);
+	}
+}
+
+#ifdef HIBAG_DISPATCH_PEXT
+__attribute__((target("bmi2")))
+static void _GatherBits_BMI2(int nM, const int Word[], const uint64_t Mask[],
+	const uint64_t *p1, const uint64_t *p2, const uint64_t *pV,
+	uint64_t S1[], uint64_t S2[], uint64_t SV[])
+{
+	int pos = 0;
+	for (int i=0; i < nM; i++)
+	{
+		const int w = Word[i];
+		const uint64_t m = Mask[i];
+		_AppendBits(S1, pos, _pext_u64(p1[w], m));
+		_AppendBits(S2, pos, _pext_u64(p2[w], m));
+		_AppendBits(SV, pos, _pext_u64(pV[w], m));
+		pos += POPCNT_U64(m);
+	}
+}
+#endif
+
+/// hardware PEXT if the CPU supports BMI2 at runtime
+static TGatherBitsFunc _SelectGatherBits()
+{
+#ifdef HIBAG_DISPATCH_PEXT
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("bmi2"))
+		return &_GatherBits_BMI2;
+#endif
+	return &_GatherBits;
+}
+
+static const TGatherBitsFunc GatherBits = _SelectGatherBits();
+
+/// the number of trailing zero bits, x != 0
+static inline int CTZ_U64(uint64_t x)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(x);
+#else
+	int n = 0;
+	for (; !(x & 0x01); x >>= 1) n++;
+	return n;
+#endif
+}
+
+/// ascending order of SNP indices, used for sorting the positions in a
+//    classifier
+struct _SNPIndexLess
+{
+	const int *Index;
+	_SNPIndexLess(const int *idx): Index(idx) { }
+	bool operator()(int a, int b) const { return Index[a] < Index[b]; }
+};
 
-	for (int i=0; i < n_samp; i++, genomat+=nSNP())
+void CAttrBag_Model::_InitPredMask(const int weights[])
+{
+	_PredNumWord = (nSNP() + 63) / 64;
+	_PredMask.resize(_ClassifierList.size());
+	for (size_t c=0; c < _ClassifierList.size(); c++)
 	{
-		_PredictHLA(genomat, &Weight[0], vote_method);
-		for (int j=0; j < n; j++)
-			*OutProb++ = _Predict.SumPostProb()[j];
-		Progress.Forward(1, ShowInfo);
+		const vector<int> &Idx = _ClassifierList[c]._SNPIndex;
+		TPredMask &M = _PredMask[c];
+		const int n = Idx.size();
+
+		// the positions sorted by SNP indices
+		M.BitOrder.resize(n);
+		for (int i=0; i < n; i++) M.BitOrder[i] = i;
+		std::sort(M.BitOrder.begin(), M.BitOrder.end(),
+			_SNPIndexLess(n > 0 ? &Idx[0] : NULL));
+
+		// masks
+		M.Word.clear(); M.Mask.clear();
+		M.SumWeight = 0;
+		M.Valid = true;
+		for (int i=0; i < n; i++)
+		{
+			const int j = Idx[M.BitOrder[i]];
+			const int w = j >> 6;
+			const uint64_t b = uint64_t(1) << (j & 0x3F);
+			if (M.Word.empty() || (M.Word.back() != w))
+				{ M.Word.push_back(w); M.Mask.push_back(0); }
+			if (M.Mask.back() & b) M.Valid = false;
+			M.Mask.back() |= b;
+			M.SumWeight += weights[j];
+		}
+
+		// the inference plan is compiled once and reused for all blocks of
+		//   samples, unless the prediction mode is changed
+		CAttrBag_Classifier &C = _ClassifierList[c];
+		if (!_Predict.PlanUpToDate(C._Plan))
+		{
+			_Predict.CompilePlan(C._Haplo, C._Plan,
+				(M.Valid && n > 0) ? &M.BitOrder[0] : NULL);
+		}
 	}
 }
 
-void CAttrBag_Model::_PredictHLA(const int *geno, const int weights[],
-	int vote_method)
+void CAttrBag_Model::_PredictHLABlock(const int *geno, int n_samp,
+	const int weights[], int vote_method, int OutNumClassifier[])
 {
-	TGenotype Geno;
-	_Predict.InitSumPostProbBuffer();
+	TGenotype Geno[HIBAG_PREDICT_BLOCK_SIZE];
+	int Index[HIBAG_PREDICT_BLOCK_SIZE];
+	double W[HIBAG_PREDICT_BLOCK_SIZE];
+	bool Settled[HIBAG_PREDICT_BLOCK_SIZE];
+	_Predict.InitSumPostProbBlock();
+	for (int k=0; k < n_samp; k++)
+	{
+		OutNumClassifier[k] = 0;
+		Settled[k] = false;
+	}
+
+	// pack the genotypes of samples over all SNPs into bit planes:
+	//   allele 1 (g >= 1), allele 2 (g == 2) and non-missing,
+	//   and the ranges of genotypes are checked only once
+	const size_t nW = _PredNumWord;
+	CdMemUsage MemPlanes(MEM_SCRATCH);
+	MemPlanes.Set(3 * nW * n_samp * sizeof(uint64_t));
+	vector<uint64_t> Planes(3 * nW * n_samp);
+	for (int k=0; k < n_samp; k++)
+	{
+		const int *g = geno + (size_t)k*nSNP();
+		uint64_t *p1 = &Planes[3*nW*k], *p2 = p1 + nW, *pV = p2 + nW;
+		for (int j=0; j < nSNP(); j++)
+		{
+			const int v = g[j];
+			if ((0 <= v) && (v <= 2))
+			{
+				const uint64_t b = uint64_t(1) << (j & 0x3F);
+				pV[j >> 6] |= b;
+				if (v >= 1) p1[j >> 6] |= b;
+				if (v == 2) p2[j >> 6] |= b;
+			}
+		}
+	}
 
-	// missing proportion
+	const bool early_exit = (_EarlyExitTol > 0);
+
+	// classifier-outer: the haplotype list of a classifier is used by
+	//   all samples in the block before moving to the next classifier
+	int nSettled = 0;
 	vector<CAttrBag_Classifier>::const_iterator it;
 	for (it = _ClassifierList.begin(); it != _ClassifierList.end(); it++)
 	{
+		const TPredMask &M = _PredMask[it - _ClassifierList.begin()];
 		const int n = it->nSNP();
-		int nWeight=0, SumWeight=0;
-		for (int i=0; i < n; i++)
+		const int nM = M.Word.size();
+		int nValid = 0;
+
+		for (int k=0; k < n_samp; k++)
 		{
-			int k = it->_SNPIndex[i];
-			SumWeight += weights[k];
-			if ((0 <= geno[k]) && (geno[k] <= 2))
-				nWeight += weights[k];
+			if (Settled[k]) continue;
+			const uint64_t *p1 = &Planes[3*nW*k], *p2 = p1 + nW, *pV = p2 + nW;
+
+			// missing proportion, from the missing SNPs only
+			int nWeight = M.SumWeight;
+			if (M.Valid)
+			{
+				for (int i=0; i < nM; i++)
+				{
+					const int w = M.Word[i];
+					for (uint64_t m = ~pV[w] & M.Mask[i]; m; m &= m - 1)
+						nWeight -= weights[(w << 6) + CTZ_U64(m)];
+				}
+			} else {
+				for (int i=0; i < n; i++)
+				{
+					const int j = it->_SNPIndex[i];
+					if (!((pV[j >> 6] >> (j & 0x3F)) & 0x01))
+						nWeight -= weights[j];
+				}
+			}
+
+			/// set weight with respect to missing SNPs
+			if (nWeight > 0)
+			{
+				if (M.Valid)
+				{
+					// gather the bits of the classifier in the order of SNPs
+					uint64_t S1[HIBAG_PACKED_UTYPE_MAXNUM/8+1];
+					uint64_t S2[HIBAG_PACKED_UTYPE_MAXNUM/8+1];
+					uint64_t SV[HIBAG_PACKED_UTYPE_MAXNUM/8+1];
+					memset(S1, 0, sizeof(S1));
+					memset(S2, 0, sizeof(S2));
+					memset(SV, 0, sizeof(SV));
+					GatherBits(nM, &M.Word[0], &M.Mask[0], p1, p2, pV,
+						S1, S2, SV);
+					for (int b=0; b < ((n + 7) >> 3); b++)
+					{
+						const int sh = (b & 0x07) << 3;
+						Geno[k].PackedSNP1[b] = (UINT8)(S1[b >> 3] >> sh);
+						Geno[k].PackedSNP2[b] = (UINT8)(S2[b >> 3] >> sh);
+						Geno[k].PackedMissing[b] = (UINT8)(SV[b >> 3] >> sh);
+					}
+				} else {
+					Geno[k].IntToSNP(n, geno + (size_t)k*nSNP(),
+						&(it->_SNPIndex[0]));
+				}
+				W[nValid] = double(nWeight) / M.SumWeight;
+				Index[nValid++] = k;
+			}
 		}
 
-		/// set weight with respect to missing SNPs
-		if (nWeight > 0)
-		{
-			Geno.IntToSNP(n, geno, &(it->_SNPIndex[0]));
-			_Predict.PredictPostProb(it->_Haplo, Geno);
+		if (nValid <= 0) continue;
+		_Predict.PredictPostProbBlock(it->_Plan, Geno, Index, nValid);
 
+		for (int k=0; k < nValid; k++)
+		{
 			if (vote_method == 1)
 			{
 				// predicting based on the averaged posterior probabilities
-				_Predict.AddProbToSum(double(nWeight) / SumWeight);
+				_Predict.AddProbToSumBlock(Index[k], W[k]);
 			} else if (vote_method == 2)
 			{
 				// predicting by class majority voting
-				THLAType pd = _Predict.BestGuess();
-				if ((pd.Allele1 != NA_INTEGER) && (pd.Allele2 != NA_INTEGER))
-				{
-					_Predict.InitPostProbBuffer();  // fill by ZERO
-					_Predict.IndexPostProb(pd.Allele1, pd.Allele2) = 1.0;
+				_Predict.AddVoteToSumBlock(Index[k]);
+			}
+			OutNumClassifier[Index[k]] ++;
+		}
 
-					// _Predict.AddProbToSum(double(nWeight) / SumWeight);
-					_Predict.AddProbToSum(1.0);
+		// early exit
+		if (early_exit)
+		{
+			for (int k=0; k < nValid; k++)
+			{
+				const int i = Index[k];
+				if (_Predict.SettledBlock(i, _EarlyExitTol,
+					_ClassifierList.end() - it - 1))
+				{
+					Settled[i] = true;
+					nSettled ++;
 				}
 			}
+			if (nSettled >= n_samp) break;
 		}
 	}
 
-	_Predict.NormalizeSumPostProb();
+	_Predict.NormalizeSumPostProbBlock();
 }
 
 void CAttrBag_Model::_GetSNPWeights(int OutWeight[])
@@ -30,12 +30,14 @@
 
 #include <stdint.h>
 #include <cstdlib>
+#include <climits>
 #include <cstring>
 #include <cstdarg>
 #include <ctime>
 #include <cmath>
 #include <vector>
 #include <list>
+#include <map>
 #include <string>
 #include <algorithm>
 
@@ -85,6 +87,21 @@
 #endif
 
 
+// Bit Manipulation Instruction Set 2 (PEXT), used directly with -mbmi2,
+//   otherwise compiled for x86-64 with GCC (>= 5) or Clang and selected
+//   at runtime
+
+#if defined(HIBAG_REG_BIT64) && defined(__BMI2__)
+#   include <immintrin.h>
+#   define HIBAG_HARDWARE_PEXT
+#elif defined(HIBAG_REG_BIT64) && defined(__x86_64__) && \
+	(defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 5)))
+#   include <immintrin.h>
+#   define HIBAG_HARDWARE_PEXT
+#   define HIBAG_DISPATCH_PEXT
+#endif
+
+
 namespace HLA_LIB
 {
 	/// Kernel Version, Major Number (0x01) / Minor Number (0x03)
@@ -106,6 +123,9 @@ namespace HLA_LIB
 	const size_t HIBAG_PACKED_UTYPE_MAXNUM =
 		HIBAG_MAXNUM_SNP_IN_CLASSIFIER / (8*sizeof(UINT8));
 
+	/** The number of samples predicted together by each classifier. **/
+	const int HIBAG_PREDICT_BLOCK_SIZE = 64;
+
 
 
 	// ===================================================================== //
@@ -147,7 +167,7 @@ namespace HLA_LIB
 	struct THaplotype
 	{
 	public:
-		friend class CHaplotypeList;
+		friend class CDoubleHaploList;
 
 		/// packed SNP alleles
 		UINT8 PackedHaplo[HIBAG_PACKED_UTYPE_MAXNUM];
@@ -181,22 +201,16 @@ namespace HLA_LIB
 	public:	
 		CHaplotypeList();
 
-		/// initialize haplotypes for EM algorithm
-		void DoubleHaplos(CHaplotypeList &OutHaplos) const;
-		/// initialize haplotypes for EM algorithm with the allele frequency of the new SNP
-		void DoubleHaplosInitFreq(CHaplotypeList &OutHaplos, const double AFreq) const;
-		/// merge rare haplotypes
-		void MergeDoubleHaplos(const double RareProb, CHaplotypeList &OutHaplos) const;
-		/// remove rare haplotypes
-		void EraseDoubleHaplos(const double RareProb, CHaplotypeList &OutHaplos) const;
-		/// save frequency to old.frequency, and set current freq. to be 0
-		void SaveClearFrequency();
 		/// scale the haplotype frequencies by a factor
 		void ScaleFrequency(const double scale);
 		/// the total number of haplotypes
 		size_t TotalNumOfHaplo() const;
+		/// the number of bytes allocated for the haplotypes
+		size_t MemBytes() const;
 		/// the total number of unique HLA alleles
 		inline size_t nHLA() const { return List.size(); }
+		/// exchange the haplotypes with another list without copying
+		void Swap(CHaplotypeList &Other);
 
 		/// haplotype list with HLA allele index
 		vector< vector<THaplotype> > List;
@@ -205,6 +219,42 @@ namespace HLA_LIB
 	};
 
 
+	/** A list of haplotypes doubled by the alleles of a new SNP, represented
+	 *    implicitly by the parent haplotypes and a side array of frequencies,
+	 *    the doubled haplotype '2*i + allele' refers to the i-th parent in the
+	 *    order of HLA alleles
+	**/
+	class CDoubleHaploList
+	{
+	public:
+		CDoubleHaploList();
+
+		/// initialize with the parent haplotypes, which should stay unchanged
+		void Init(const CHaplotypeList &Parent);
+		/// initialize the frequencies with the allele frequency of the new SNP
+		void InitFreq(const double AFreq);
+		/// save frequency to old.frequency, and set current freq. to be 0
+		void SaveClearFrequency();
+		/// scale the haplotype frequencies by a factor
+		void ScaleFrequency(const double scale);
+		/// materialize the haplotypes except the rare ones
+		void EraseDoubleHaplos(const double RareProb, CHaplotypeList &OutHaplos) const;
+		/// the total number of doubled haplotypes
+		inline size_t TotalNumOfHaplo() const { return Frequency.size(); }
+		/// the number of bytes allocated
+		size_t MemBytes() const;
+
+		/// the parent haplotypes
+		const CHaplotypeList *Parent;
+		/// the index of the first parent haplotype for each HLA allele
+		vector<int> Start;
+		/// haplotype frequencies
+		vector<double> Frequency;
+		/// old haplotype frequencies
+		vector<double> OldFreq;
+	};
+
+
 	/// Packed SNP genotype structure: 8 SNPs in a byte
 	class TGenotype
 	{
@@ -290,6 +340,8 @@ namespace HLA_LIB
 
 		/// add a new SNP
 		void AddSNP(int IdxSNP, const CSNPGenoMatrix &SNPMat);
+		/// add a new SNP with the genotypes (0, 1, 2, or 3 for missing) of all samples
+		void AddSNP(const UINT8 Geno[]);
 		/// remove the last SNP
 		void ReduceSNP();
 
@@ -326,6 +378,158 @@ namespace HLA_LIB
 
 
 
+	// ===================================================================== //
+	// ========                  memory accounting                  ========
+
+	/// the subsystems for memory accounting
+	enum TMemSubsystem
+	{
+		MEM_GENOTYPE = 0,   //< genotype store, HLA types and bootstrap counts
+		MEM_HAPLOTYPE,      //< haplotype lists
+		MEM_EM_PAIR,        //< haplotype pair lists of EM algorithm
+		MEM_SCRATCH,        //< scratch buffers
+		MEM_OUTPUT,         //< output buffers
+		MEM_NUM_SUBSYSTEM   //< the number of subsystems
+	};
+
+	/// The current and peak memory usage of the engine
+	class CdMemAccount
+	{
+	public:
+		CdMemAccount();
+
+		/// account for the change from OldBytes to NewBytes, throw an exception
+		//    if the total number of bytes exceeds the budget
+		void Update(TMemSubsystem Sub, size_t OldBytes, size_t NewBytes);
+		/// throw an exception if allocating 'Bytes' would exceed the budget
+		void Check(TMemSubsystem Sub, size_t Bytes) const;
+		/// reset the peak usage to the current usage
+		void ResetPeak();
+
+		/// the current number of bytes
+		inline size_t Current(TMemSubsystem Sub) const { return fCurrent[Sub]; }
+		/// the peak number of bytes
+		inline size_t Peak(TMemSubsystem Sub) const { return fPeak[Sub]; }
+		/// the current number of bytes in total
+		inline size_t TotalCurrent() const { return fTotal; }
+		/// the peak number of bytes in total
+		inline size_t TotalPeak() const { return fTotalPeak; }
+
+		/// the name of subsystem
+		static const char *Name(TMemSubsystem Sub);
+
+		/// the memory budget in bytes, 0 for no limit
+		size_t Budget;
+
+	protected:
+		/// throw an exception of exceeding the budget
+		void _ThrowBudget(TMemSubsystem Sub, size_t Bytes, size_t Total) const;
+
+		size_t fCurrent[MEM_NUM_SUBSYSTEM];  //< the current usage
+		size_t fPeak[MEM_NUM_SUBSYSTEM];     //< the peak usage
+		size_t fTotal;      //< the current usage in total
+		size_t fTotalPeak;  //< the peak usage in total
+	};
+
+	/// the memory accounting of the engine
+	extern CdMemAccount MemAccount;
+
+
+	/// The memory usage of an object, registered in 'MemAccount'
+	class CdMemUsage
+	{
+	public:
+		CdMemUsage(TMemSubsystem Sub);
+		CdMemUsage(const CdMemUsage &src);
+		~CdMemUsage();
+
+		CdMemUsage &operator= (const CdMemUsage &src);
+
+	#if (__cplusplus >= 201103L)
+		/// hand over the bytes without charging the budget again, so that
+		//    the reallocation of a vector of owners never throws
+		CdMemUsage(CdMemUsage &&src) noexcept;
+		CdMemUsage &operator= (CdMemUsage &&src) noexcept;
+	#endif
+
+		/// set the number of bytes, throw an exception if exceeding the budget
+		void Set(size_t Bytes);
+		/// the number of bytes
+		inline size_t Bytes() const { return fBytes; }
+
+	protected:
+		TMemSubsystem fSub;  //< the subsystem
+		size_t fBytes;       //< the number of bytes
+	};
+
+
+
+
+	// ===================================================================== //
+	// ========                   packed SNP matrix                 ========
+
+	/// SNP genotypes packed in bit planes over samples, for the statistics of
+	//    all SNPs: a genotype is G1 + G2 with G1 = (g >= 1) and G2 = (g == 2)
+	class CPackedSNPMatrix
+	{
+	public:
+		CPackedSNPMatrix();
+
+		/// set the number of threads used by the following functions
+		void SetNumThread(int n);
+		/// the number of threads
+		inline int NumThread() const { return _nThread; }
+
+		/// pack the genotypes of a 'n_snp'-by-'n_samp' matrix, the values
+		//    other than 0, 1 and 2 are treated as missing
+		void Init(const int *geno, int n_snp, int n_samp);
+
+		/// composite linkage disequilibrium (r2) between each SNP and each HLA
+		//    allele over pairwise complete observations, 'H1' and 'H2' are
+		//    from 0 to n_allele-1 (others for missing), 'OutMeanR2' is the
+		//    mean of finite r2 over alleles, and 'OutR2' is a 'nSNP'-by-
+		//    'n_allele' matrix if it is not NULL
+		void LD_HLA(const int H1[], const int H2[], int n_allele,
+			double OutMeanR2[], double OutR2[]) const;
+
+		/// the allele frequency and missing rate of each SNP, the missing
+		//    rate of each sample, and whether each SNP is monomorphic (all
+		//    genotypes are missing, 0 or 2), NaN if undefined; any output can
+		//    be NULL
+		void Summary(double OutAFreq[], double OutMissSNP[],
+			double OutMissSamp[], int OutMono[]) const;
+
+		/// the number of SNPs
+		inline int nSNP() const { return _nSNP; }
+		/// the number of samples
+		inline int nSamp() const { return _nSamp; }
+		/// the number of 64-bit words of each bit plane
+		inline size_t nWord() const { return _nWord; }
+
+		/// the non-missing flags of the j-th SNP
+		inline const uint64_t *Valid(int j) const
+			{ return &_Bits[3*_nWord*j]; }
+		/// the bit plane of (g >= 1) of the j-th SNP
+		inline const uint64_t *G1(int j) const
+			{ return &_Bits[3*_nWord*j + _nWord]; }
+		/// the bit plane of (g == 2) of the j-th SNP
+		inline const uint64_t *G2(int j) const
+			{ return &_Bits[3*_nWord*j + 2*_nWord]; }
+
+	protected:
+		int _nSNP;      //< the number of SNPs
+		int _nSamp;     //< the number of samples
+		size_t _nWord;  //< the number of words of each bit plane
+		int _nThread;   //< the number of threads
+		/// the bit planes of SNPs, Valid, G1 and G2 for each SNP
+		vector<uint64_t> _Bits;
+		/// the memory usage of bit planes
+		CdMemUsage _MemBits;
+	};
+
+
+
+
 	// ===================================================================== //
 	// ========                      algorithm                      ========
 
@@ -338,54 +542,45 @@ namespace HLA_LIB
 	extern double EM_FuncRelTol;  // = sqrt(DBL_EPSILON)
 
 
-	/// variable sampling
-	class CBaseSampling
-	{
-	public:
-		/// the total number of candidate SNPs
-		virtual int TotalNum() const = 0;
-		/// randomly select 'm_try' SNPs for further searching
-		virtual void RandomSelect(int m_try) = 0;
-		/// the number of selected SNPs
-		virtual int NumOfSelection() const = 0;
-		/// remove the 'idx' SNP
-		virtual void Remove(int idx) = 0;
-		/// remove the selected SNPs
-		virtual void RemoveSelection() = 0;
-		/// remove the SNPs with flag
-		virtual void RemoveFlag() = 0;
-		/// get SNP index
-		virtual int &operator[] (int idx) = 0;
-	};
-
-
-	/// variable sampling without replacement
-	class CSamplingWithoutReplace: public CBaseSampling
+	/** variable sampling without replacement: the selected SNPs are kept at
+	 *    the end of the candidate pool, so removing them only moves the
+	 *    selection and the calls are not virtual
+	**/
+	class CSamplingWithoutReplace
 	{
 	public:
 		CSamplingWithoutReplace();
-		CBaseSampling *Init(int m_total);
+		CSamplingWithoutReplace *Init(int m_total);
+		/// set the sampling weights of all SNPs, or NULL for equal probabilities,
+		//    the SNPs with ZERO weights are excluded by the next Init()
+		void SetWeight(const double weight[], int n);
 
 		/// the total number of candidate SNPs
-		virtual int TotalNum() const;
+		inline int TotalNum() const { return _IdxArray.size(); }
 		/// randomly select 'm_try' SNPs for further searching
-		virtual void RandomSelect(int m_try);
+		void RandomSelect(int m_try);
 		/// the number of selected SNPs
-		virtual int NumOfSelection() const;
+		inline int NumOfSelection() const { return _m_try; }
 		/// remove the 'idx' SNP
-		virtual void Remove(int idx);
+		void Remove(int idx);
 		/// remove the selected SNPs
-		virtual void RemoveSelection();
-		/// remove the SNPs with flag
-		virtual void RemoveFlag();
+		inline void RemoveSelection()
+			{ _IdxArray.resize(_IdxArray.size() - _m_try); _m_try = 0; }
+		/// remove the SNPs with flag (a negative SNP index)
+		void RemoveFlag();
 		/// get SNP index
-		virtual int &operator[] (int idx);
+		inline int &operator[] (int idx)
+			{ return _IdxArray[_IdxArray.size() - _m_try + idx]; }
 
 	protected:
 		/// saving the SNP indices
 		vector<int> _IdxArray;
 		/// the number of selected SNPs
 		int _m_try;
+		/// the sampling weights of SNPs, empty for equal probabilities
+		vector<double> _Weight;
+		/// the random keys of weighted sampling
+		vector< pair<double, int> > _Key;
 	};
 
 
@@ -393,45 +588,101 @@ namespace HLA_LIB
 	class CAlg_EM
 	{
 	public:
+		friend class CVariableSelection;
+
 		CAlg_EM();
 
 		// call PrepareHaplotypes first, and then call PrepareNewSNP
 
-		/// 
+		/// the first 'NumInBag' samples in GenoList and HLAList are in-bag, followed by out-of-bag samples
 		void PrepareHaplotypes(const CHaplotypeList &CurHaplo,
 			const CGenotypeList &GenoList, const CHLATypeList &HLAList,
-			CHaplotypeList &NextHaplo);
+			int NumInBag, CDoubleHaploList &NextHaplo);
 
-		/// , return true if the new SNP is not monomorphic
-		bool PrepareNewSNP(const int NewSNP, const CHaplotypeList &CurHaplo,
-			const CSNPGenoMatrix &SNPMat, CGenotypeList &GenoList, CHaplotypeList &NextHaplo);
+		/// 'NewGeno' are the genotypes of the samples in GenoList, return true if the new SNP is not monomorphic
+		///   (the frequencies are left unchanged if InitFreq = false)
+		bool PrepareNewSNP(const UINT8 NewGeno[], const CGenotypeList &GenoList,
+			CDoubleHaploList &NextHaplo, bool InitFreq=true);
 
-		/// call EM algorithm to estimate haplotype frequencies
-		void ExpectationMaximization(CHaplotypeList &NextHaplo);
+		/// the state of EM algorithm, for continuing the iterations
+		struct TEMState
+		{
+			int Iter;        //< the number of iterations done
+			double LogLik;   //< the log likelihood of the last iteration
+			double ConvTol;  //< the convergence tolerance
+			bool Converged;  //< if true, EM algorithm has converged
+
+			TEMState() { Iter = 0; LogLik = -1e+30; ConvTol = 0; Converged = false; }
+		};
+
+		/// call EM algorithm to estimate haplotype frequencies, return the number of iterations
+		int ExpectationMaximization(CDoubleHaploList &NextHaplo);
+		/// continue EM algorithm for at most 'MaxIter' iterations, return the total number of iterations
+		int ExpectationMaximization(CDoubleHaploList &NextHaplo, TEMState &State,
+			int MaxIter);
+
+		/// the total number of haplotype pairs for all samples
+		size_t TotalNumOfPair() const;
+
+		/** the conditional entropy of in-bag HLA alleles given the genotypes
+		 *    at the selected SNPs and the new SNP, multiplied by the number of
+		 *    in-bag HLA alleles, lower for a more informative new SNP, called
+		 *    after PrepareHaplotypes
+		**/
+		double ScreenEntropy(const UINT8 NewGeno[], const CGenotypeList &GenoList);
 
 	protected:
-		/// A pair of haplotypes
+		/** A pair of parent haplotypes, standing for the pairs of their
+		 *    doubled haplotypes, and the pairs with the same H1 are adjacent
+		**/
 		struct THaploPair
 		{
-			bool Flag;       //< if true, the haplotype pair exists in the sample
-			THaplotype *H1;  //< the first haplotype
-			THaplotype *H2;  //< the second haplotype
-			double Freq;     //< genotype frequency
+			int H1;  //< the index of the first parent haplotype
+			int H2;  //< the index of the second parent haplotype
+
+			THaploPair() { H1 = H2 = 0; }
+			THaploPair(int i1, int i2) { H1 = i1; H2 = i2; }
+		};
 
-			THaploPair() { Flag = true; H1 = H2 = NULL; }
-			THaploPair(THaplotype *i1, THaplotype *i2) { Flag = true; H1 = i1; H2 = i2; }
+		/** A group of samples with the same SNP genotypes and HLA type, which
+		 *    is split by the genotypes (0, 1, 2 and missing) at the new SNP
+		**/
+		struct TSampGroup
+		{
+			vector<int> SampIndex;  //< the sample indices in the source data
+			int BootstrapCount;     //< the total count in the bootstrapped data,
+			                        //    or the number of out-of-bag samples
+			int ClassCount[4];      //< the counts of each genotype at the new SNP
+			int ClassSamp[4];       //< the first sample of each genotype, or -1
 		};
 
-		/// A list of haplotype pairs
-		struct THaploPairList
+		/// A group of samples with a list of haplotype pairs
+		struct THaploPairList: public TSampGroup
 		{
-			int BootstrapCount;           //< the count in the bootstrapped data
-			int SampIndex;                //< the sample index in the source data
+			THLAType HLA;                 //< the HLA type of the group
 			vector<THaploPair> PairList;  //< a list of haplotype pairs
 		};
 
-		/// pairs of haplotypes for individuals
+		/// pairs of haplotypes for the groups of in-bag individuals
 		vector<THaploPairList> _SampHaploPair;
+		/// the groups of out-of-bag individuals
+		vector<TSampGroup> _OutOfBagGroup;
+		/// the in-bag groups ordered by the genotype patterns at the selected SNPs
+		vector<int> _PatternGroup;
+		/// the start of each genotype pattern in '_PatternGroup', with an end
+		vector<int> _PatternStart;
+		/// the counts of HLA alleles used in 'ScreenEntropy'
+		vector<int> _ScreenCnt;
+
+		/// the sum of frequencies of the doubled pairs compatible with the
+		///   genotype (3 for missing), or add them multiplied by Ratio to Freq
+		static double _PairFreq(const vector<THaploPair> &PairList, int Geno,
+			const double OldFreq[], double Freq[], double Ratio);
+		/// split the samples in a group by the genotypes at the new SNP
+		static void _SplitGroup(TSampGroup &G, const UINT8 NewGeno[],
+			const CGenotypeList &GenoList, bool in_bag);
+		/// the memory usage of '_SampHaploPair'
+		CdMemUsage _MemPair;
 	};
 
 
@@ -441,6 +692,54 @@ namespace HLA_LIB
 	public:
 		friend class CVariableSelection;
 
+		/// A run of haplotype pairs in the inference plan, (H1, H2[0]),
+		//    (H1, H2[1]), ..., with H2 contiguous in 'Bits'
+		struct TPlanRun
+		{
+			int IdxH1;    //< the index of the first haplotype in 'Bits'
+			int IdxH2;    //< the index of the first H2 in 'Bits'
+			int NumH2;    //< the number of pairs in the run
+			size_t IdxW;  //< the index of the first pair in 'Weight'
+		};
+
+		/// The inference plan compiled from a haplotype list, which can be
+		//    kept with a classifier and reused for all blocks of samples
+		struct TPlan
+		{
+			/// the packed haplotypes, contiguous, 'NumWord' 64-bit words
+			//    per haplotype
+			vector<uint64_t> Bits;
+			/// the number of haplotypes
+			int NumHaplo;
+			/// the start of each HLA allele in 'Bits', NumHLA+1 entries
+			vector<int> HaploStart;
+			/// the number of 64-bit words per haplotype
+			int NumWord;
+			/// the runs of haplotype pairs grouped by the pair of HLA alleles
+			vector<TPlanRun> Run;
+			/// the frequencies of haplotype pairs, in the same order as 'Run'
+			vector<double> Weight;
+			/// the sum of frequencies from a pair to the end of its run, used
+			//    in the approximate mode
+			vector<double> TailW;
+			/// the sum of 'Weight', used for the error bound of pruning
+			double SumWeight;
+			/// the start of each pair of HLA alleles in 'Run'
+			vector<int> Slot;
+			/// the number of SNPs
+			size_t NumSNP;
+			/// the number of HLA alleles, 0 if not compiled
+			int NumHLA;
+			/// whether it is compiled for the approximate mode
+			bool Approx;
+			/// the memory usage
+			CdMemUsage Mem;
+
+			TPlan(TMemSubsystem Sub=MEM_SCRATCH);
+			/// release the plan
+			void Clear();
+		};
+
 		CAlg_Prediction();
 
 		/// initialize
@@ -461,14 +760,64 @@ namespace HLA_LIB
 		/// 
 		double &IndexSumPostProb(int H1, int H2);
 
-		/// predict based on SNP profiles and haplotype list,
+		/// compile the haplotype list into a flat inference plan, which is
+		//    used by the following single-sample prediction functions; the
+		//    k-th SNP of the plan is the BitOrder[k]-th SNP of 'Haplo' if
+		//    BitOrder != NULL
+		void CompilePlan(const CHaplotypeList &Haplo, const int BitOrder[]=NULL);
+		/// compile the haplotype list into 'OutPlan' for the block prediction
+		void CompilePlan(const CHaplotypeList &Haplo, TPlan &OutPlan,
+			const int BitOrder[]=NULL) const;
+		/// whether 'Plan' is compiled for the current number of HLA alleles
+		//    and the current mode (exact or approximate)
+		inline bool PlanUpToDate(const TPlan &Plan) const
+			{ return (Plan.NumHLA == _nHLA) && (Plan.Approx == (_Epsilon > 0)); }
+
+		/** set the tolerance of pruning haplotype pairs: the pairs with
+		 *    MIN_RARE_FREQ^d <= tol are skipped, where d is a lower bound of
+		 *    the Hamming distance; tol = 0 gives the exact prediction
+		**/
+		void SetPruneTol(double tol);
+		/// the tolerance of pruning haplotype pairs
+		inline double PruneTol() const { return _PruneTol; }
+
+		/** set the approximate mode: 'eps' > 0 for the max error of posterior
+		 *    probabilities in the block prediction, and 0 for the exact mode
+		**/
+		void SetEpsilon(double eps);
+		/// the max error of posterior probabilities in the approximate mode
+		inline double Epsilon() const { return _Epsilon; }
+
+		/// predict based on SNP profiles and the compiled haplotype list,
 		//    and save posterior probabilities in '_PostProb'
-		void PredictPostProb(const CHaplotypeList &Haplo, const TGenotype &Geno);
+		void PredictPostProb(const TGenotype &Geno);
 		/// the best-guess HLA type from '_PostProb'
 		THLAType BestGuess();
 		/// the best-guess HLA type from '_SumPostProb'
 		THLAType BestGuessEnsemble();
 
+		/// initialize the buffers for a block of samples
+		void InitBlockBuffer();
+		/// initialize the sums of posterior probabilities in the block by setting ZERO
+		void InitSumPostProbBlock();
+		/// predict based on SNP profiles 'Geno[Index[i]]' and the compiled plan,
+		//    and save posterior probabilities in the rows 'Index[i]' of the block
+		void PredictPostProbBlock(const TPlan &Plan, const TGenotype Geno[],
+			const int Index[], int n);
+		/// add the posterior probabilities of the i-th sample in the block with a weight
+		void AddProbToSumBlock(int i, const double weight);
+		/// add a vote for the best-guess HLA type of the i-th sample in the block
+		void AddVoteToSumBlock(int i);
+		/// average over all classifiers for each sample in the block
+		void NormalizeSumPostProbBlock();
+		/// the best-guess HLA type from the sums of the i-th sample in the block
+		THLAType BestGuessEnsembleBlock(int i) const;
+		/// whether the best-guess HLA type of the i-th sample in the block
+		//    can not change and its averaged posterior probability can not
+		//    move by more than 'tol' whatever 'n_remain' classifiers not
+		//    evaluated yet predict
+		bool SettledBlock(int i, double tol, int n_remain) const;
+
 		/// get the number of unique HLA alleles
 		inline const int nHLA() const
 			{ return _nHLA; }
@@ -478,27 +827,134 @@ namespace HLA_LIB
 		/// the average posterior probabilities for all classifiers
 		inline const vector<double> &SumPostProb() const
 			{ return _SumPostProb; }
+		/// the average posterior probabilities of the i-th sample in the block
+		inline const double *SumPostProbBlock(int i) const
+			{ return &_BlockSumPostProb[(size_t)i * _nPairHLA]; }
+		/// the error bound of the average posterior probabilities of the i-th
+		//    sample in the block, ZERO in the exact mode
+		inline double SumErrBoundBlock(int i) const
+			{ return _BlockSumErrBound[i]; }
+		/// the index of a pair of HLA alleles in posterior probabilities
+		inline int IndexPair(int H1, int H2) const
+			{
+				if (H1 > H2) std::swap(H1, H2);
+				return H2 + H1*(2*_nHLA-H1-1)/2;
+			}
 
 	protected:
 		/// the number of different HLA alleles
 		int _nHLA;
+		/// the number of pairs of HLA alleles, _nHLA*(_nHLA+1)/2
+		int _nPairHLA;
 		/// plus weight after calling AddProbToSum()
 		double _Sum_Weight;
 		/// a vector of posterior probabilities
 		vector<double> _PostProb;
 		/// a vector of posterior probabilities for summing up
 		vector<double> _SumPostProb;
-
-		/// the best-guess HLA type based on SNP profiles and haplotype list
-		//    without saving posterior probabilities in '_PostProb'
-		THLAType _PredBestGuess(const CHaplotypeList &Haplo, const TGenotype &Geno);
-		/// the prob of the given HLA type based on SNP profiles and haplotype list
-		//    without saving posterior probabilities in '_PostProb'
-		double _PredPostProb(const CHaplotypeList &Haplo, const TGenotype &Geno,
-			const THLAType &HLA);
+		/// the memory usage of posterior probabilities
+		CdMemUsage _MemProb;
+
+		/// posterior probabilities for a block of samples
+		vector<double> _BlockPostProb;
+		/// the sums of posterior probabilities for a block of samples
+		vector<double> _BlockSumPostProb;
+		/// plus weight for each sample in the block
+		vector<double> _BlockSumWeight;
+		/// the error bounds of posterior probabilities in the block
+		vector<double> _BlockErrBound;
+		/// the sums of error bounds in the block
+		vector<double> _BlockSumErrBound;
+		/// the memory usage of the block buffers
+		CdMemUsage _MemBlock;
+
+		/// the inference plan compiled from the haplotype list by CompilePlan()
+		TPlan _Plan;
+
+		/// the tolerance of pruning haplotype pairs
+		double _PruneTol;
+		/// the pairs with a distance lower bound >= '_PruneDist' are skipped
+		int _PruneDist;
+		/// the pairs with a distance >= '_ExactDist' have ZERO frequency
+		int _ExactDist;
+		/// the max error of posterior probabilities in the approximate mode
+		double _Epsilon;
+
+		/** The SNP genotypes of a sample decomposed for the inference plan:
+		 *    the Hamming distance between the genotype and a haplotype pair
+		 *    (H1, H2) is HomDiff[H1] + HomDiff[H2] + NumHet -
+		 *    popcount((H1 ^ H2) & HetMask), where HomDiff[i] is the number
+		 *    of mismatches between the i-th haplotype and the genotype at
+		 *    the non-missing homozygous sites, and HomDiff[H1] + HomDiff[H2]
+		 *    is a lower bound of the distance
+		**/
+		struct TGenoDecomp
+		{
+			uint64_t HetMask[HIBAG_PACKED_UTYPE_MAXNUM/8];  //< heterozygous sites
+			int NumHet;  //< the number of non-missing heterozygous sites
+		};
+		/// the mismatches at homozygous sites for the haplotypes in the plan,
+		//    followed by the minimum and maximum for each HLA allele
+		vector<int> _HomDiff;
+		/// the number of entries in '_HomDiff' for a sample given the plan
+		inline size_t _HomDiffSize(const TPlan &P) const
+			{ return P.NumHaplo + 2*_nHLA; }
+
+		/// decompose the SNP genotypes, and save the mismatches at homozygous
+		//    sites in 'OutHomDiff' with '_HomDiffSize(P)' entries
+		void _DecompGeno(const TPlan &P, const TGenotype &Geno,
+			TGenoDecomp &Out, int OutHomDiff[]) const;
+		/// the sum of frequencies of haplotype pairs in the idx-th slot for
+		//    the HLA allele pair (*, h2), skipping the pairs with a distance
+		//    lower bound >= D
+		inline double _SlotProb(const TPlan &P, int idx, int h2,
+			const TGenoDecomp &G, const int HomDiff[], int D) const;
+		/// the sums of frequencies of haplotype pairs in all slots, and
+		//    return the total
+		double _SlotProbAll(const TPlan &P, const TGenoDecomp &G,
+			const int HomDiff[], int D, double Out[]) const;
+		/// the sums of frequencies in all slots in the approximate mode, where
+		//    the remaining pairs of a run are skipped if their frequencies are
+		//    bounded, and return the total with the error bound of posterior
+		//    probabilities in 'OutBound'
+		double _SlotProbApprox(const TPlan &P, const TGenoDecomp &G,
+			const int HomDiff[], double Out[], double &OutBound) const;
+
+		/// the best-guess HLA type from a vector of posterior probabilities
+		THLAType _BestGuess(const double *p) const;
+
+		/// the best-guess HLA type based on SNP profiles and the compiled
+		//    haplotype list without saving posterior probabilities in '_PostProb'
+		THLAType _PredBestGuess(const TGenotype &Geno);
+		/// the prob of the given HLA type based on SNP profiles and the compiled
+		//    haplotype list without saving posterior probabilities in '_PostProb'
+		double _PredPostProb(const TGenotype &Geno, const THLAType &HLA);
 	};
 
 
+	/// the training trace of a forward-selection step
+	struct TSearchTrace
+	{
+		int Classifier;       //< the index of individual classifier, starting from 0
+		int Step;             //< the index of selection step, starting from 0
+		int NumCandidate;     //< the number of candidate SNPs sampled
+		int NumEvaluated;     //< the number of non-monomorphic candidates evaluated
+		int NumPruned;        //< the number of candidates removed by pruning
+		int SumEMIter;        //< the total number of EM iterations
+		int MaxEMIter;        //< the max number of EM iterations for a candidate
+		int NumHaplo;         //< the number of haplotypes before doubling
+		int NumDoubleHaplo;   //< the number of haplotypes before EraseDoubleHaplos
+		int SumReducedHaplo;  //< the total number of haplotypes after EraseDoubleHaplos
+		int NumPair;          //< the total number of haplotype pairs
+		int NewSNP;           //< the SNP added in this step, or -1 if no SNP is added
+		double OutOfBagAcc;   //< the out-of-bag accuracy after this step
+		double Loss;          //< the in-bag loss after this step
+		double TimePrepare;   //< wall time (in seconds) of PrepareHaplotypes
+		double TimeEM;        //< wall time of PrepareNewSNP, EM and EraseDoubleHaplos
+		double TimeOutOfBag;  //< wall time of computing out-of-bag accuracies
+		double TimeInBag;     //< wall time of computing in-bag log likelihoods
+	};
+
 	/// variable selection algorithm
 	class CVariableSelection
 	{
@@ -508,10 +964,43 @@ namespace HLA_LIB
 		/// initialize
 		void InitSelection(CSNPGenoMatrix &snpMat, CHLATypeList &hlaList,
 			const int _BootstrapCnt[]);
+		/// release the genotypes and working haplotype lists after the last
+		//    'Search' and 'AddOutOfBagProb'
+		void DoneSelection();
 		/// searching algorithm
-		void Search(CBaseSampling &VarSampling, CHaplotypeList &OutHaplo,
+		void Search(CSamplingWithoutReplace &VarSampling, CHaplotypeList &OutHaplo,
 			vector<int> &OutSNPIndex, double &Out_Global_Max_OutOfBagAcc,
-			int mtry, bool prune, bool verbose, bool verbose_detail);
+			int mtry, bool prune, bool verbose, bool verbose_detail,
+			vector<TSearchTrace> *OutTrace=NULL, int IdxClassifier=0);
+
+		/** set the fraction of sampled candidate SNPs evaluated by EM, which
+		 *    are the most informative ones ranked by 'CAlg_EM::ScreenEntropy';
+		 *    frac = 1 for evaluating all candidates
+		**/
+		void SetScreen(double frac);
+		/// the fraction of candidate SNPs evaluated by EM
+		inline double Screen() const { return _ScreenFrac; }
+		/** set successive halving: all candidates get a few EM iterations and
+		 *    the out-of-bag accuracy on a subsample, the better half continues
+		 *    with doubled iterations and subsample, and only the winner gets
+		 *    the exact evaluation
+		**/
+		void SetHalving(bool halving);
+		/// whether successive halving is used
+		inline bool Halving() const { return _Halving; }
+
+		/** predict the out-of-bag samples of the last 'Search' by 'Haplo',
+		 *    and add the posterior probabilities weighted by 'SampWeight' to
+		 *    'OutSumProb', a matrix of n_pair_hla x n_samp in the original
+		 *    order of samples; the samples with no weight are skipped
+		 *  \param Haplo         the haplotype list returned by 'Search'
+		 *  \param BootstrapCnt  the bootstrap counts passed to 'InitSelection'
+		 *  \param SampWeight    the weights of samples, from missing SNPs
+		 *  \param OutSumProb    the sums of posterior probabilities
+		**/
+		void AddOutOfBagProb(const CHaplotypeList &Haplo,
+			const int BootstrapCnt[], const double SampWeight[],
+			double OutSumProb[]);
 
 		/// the number of samples
 		inline int nSamp() const { return _SNPMat->Num_Total_Samp; }
@@ -526,24 +1015,145 @@ namespace HLA_LIB
 		/// a list of HLA types
 		CHLATypeList *_HLAList;
 		
-		/// a list of genotypes
+		/// a list of genotypes, in-bag samples followed by out-of-bag samples
 		CGenotypeList _GenoList;
+		/// a list of HLA types, in the same order as '_GenoList'
+		CHLATypeList _PartHLA;
+		/// the number of in-bag samples in '_GenoList'
+		int _NumInBag;
+		/// SNP-major genotypes (0, 1, 2, or 3 for missing) in the same order as '_GenoList'
+		vector<UINT8> _PartGeno;
+		/// the memory usage of '_GenoList', '_PartHLA' and '_PartGeno'
+		CdMemUsage _MemGeno;
 		/// EM algorithm
 		CAlg_EM _EM;
 		/// the prediction algorithm
 		CAlg_Prediction _Predict;
 
+		/// the working haplotype lists of 'Search', reused across steps and classifiers
+		CDoubleHaploList _NextHaplo;
+		CHaplotypeList _NextReducedHaplo, _MinHaplo;
+		/// the memory usage of the working haplotype lists
+		CdMemUsage _MemHaplo;
+		/// the fraction of candidate SNPs evaluated by EM
+		double _ScreenFrac;
+		/// if true, use successive halving to evaluate candidates
+		bool _Halving;
+		/// the saved frequencies of candidates in successive halving
+		vector<double> _HalvingFreq;
+		/// the memory usage of '_HalvingFreq'
+		CdMemUsage _MemHalving;
+
+		/// the genotypes of all samples at the specified SNP
+		inline const UINT8 *_SNPGeno(int IdxSNP) const
+			{ return &_PartGeno[size_t(IdxSNP) * _GenoList.nSamp()]; }
 		/// initialize the haplotype list
 		void _InitHaplotype(CHaplotypeList &Haplo);
-		/// compute the out-of-bag accuracy using the haplotypes 'Haplo'
-		double _OutOfBagAccuracy(CHaplotypeList &Haplo);
-		/// compute the in-bag log likelihood using the haplotypes 'Haplo'
-		double _InBagLogLik(CHaplotypeList &Haplo);
+		/// compute the out-of-bag accuracy using the haplotypes 'Haplo', on every 'Stride'-th group of out-of-bag samples
+		double _OutOfBagAccuracy(CHaplotypeList &Haplo, int Stride=1);
+		/// compute the in-bag log likelihood using the haplotypes 'Haplo', and
+		//    reuse the plan compiled by the previous _OutOfBagAccuracy() with
+		//    the same haplotypes if 'Compiled' is true
+		double _InBagLogLik(CHaplotypeList &Haplo, bool Compiled=false);
+		/// successive halving over the flagged candidates, and only the winner is left flagged;
+		//    the EM state of the winner is saved in 'OutState' with its haplotype frequencies
+		//    at the front of '_HalvingFreq' (OutState.Iter = 0 if not available)
+		void _SuccessiveHalving(CSamplingWithoutReplace &VarSampling, vector<bool> &Evaluate,
+			double RareProb, CAlg_EM::TEMState &OutState, TSearchTrace *Trace);
 	};
 
 
 
 
+	// ===================================================================== //
+	// ========                  progress information               ========
+
+	class CdProgression;
+
+	/// The basic class for the output of progress information
+	class CdProgressSink
+	{
+	public:
+		virtual ~CdProgressSink() {}
+		/// report the progress, always called from the main thread
+		virtual void Report(const CdProgression &Prog) = 0;
+	};
+
+	/// Show progress information in the R console
+	class CdProgressConsole: public CdProgressSink
+	{
+	public:
+		virtual void Report(const CdProgression &Prog);
+	};
+
+	/// Append progress information to a log file
+	class CdProgressLogFile: public CdProgressSink
+	{
+	public:
+		CdProgressLogFile(const char *fn);
+		virtual void Report(const CdProgression &Prog);
+	protected:
+		std::string FileName;  //< the file name
+	};
+
+	/// The basic class for progress object
+	class CdProgression
+	{
+	public:
+		static const int TotalPercent = 100;
+		static const int StepPercent = 1;
+
+		/// The associated information
+		std::string Info;
+		/// The unit of counts, e.g., "samples"
+		std::string Unit;
+		/// if true, report the throughput per hour instead of per second
+		bool RatePerHour;
+		/// the minimum interval (in seconds) between two reports
+		double Interval;
+
+		/// Constructor
+		CdProgression();
+
+		/// initialize
+		void Init(long TotalCnt, bool ShowInit);
+		/// move forward, thread-safe; no information is shown in a parallel
+		//    region, call 'Forward(0, Show)' after the region to report
+		bool Forward(long step, bool Show);
+		/// show progress information by calling all sinks
+		virtual void ShowProgress();
+
+		/// remove all sinks
+		void ClearSink();
+		/// add a sink, not owned by this object
+		void AddSink(CdProgressSink *sink);
+
+        /// Return the current percentile
+		inline int Percent() const { return fPercent; }
+		/// Return the total number
+		inline long Total() const { return fTotal; }
+		/// Return the current position
+		inline long Current() const { return fCurrent; }
+		/// Return the elapsed wall-clock time in seconds
+		double Elapsed() const;
+		/// Return the estimated remaining time in seconds, or NaN
+		double ETA() const;
+		/// Return the throughput, per second or per hour
+		double Rate() const;
+		/// Return a string of rate and the estimated remaining time
+		std::string RateETAStr() const;
+
+	protected:
+		long fTotal;      //< the total number
+		long fCurrent;    //< the current number
+		int fPercent;     //< the corresponding percent
+		double fStartTime;  //< the starting time point
+		double fOldTime;    //< the old time point
+		std::vector<CdProgressSink*> fSinks;  //< output sinks
+	};
+
+
+
 	// ===================================================================== //
 	// ========                   HIBAG -- model                    ========
 
@@ -564,8 +1174,9 @@ namespace HLA_LIB
 			int n_haplo, const double *freq, const int *hla,
 			const char * haplo[], double *_acc=NULL);
 		/// grow this classifier by adding SNPs
-		void Grow(CBaseSampling &VarSampling, int mtry, bool prune,
-			bool verbose, bool verbose_detail);
+		void Grow(CSamplingWithoutReplace &VarSampling, int mtry, bool prune,
+			bool verbose, bool verbose_detail,
+			vector<TSearchTrace> *OutTrace=NULL, int IdxClassifier=0);
 
 		/// the owner
 		inline CAttrBag_Model &Owner() { return *_Owner; }
@@ -593,6 +1204,13 @@ namespace HLA_LIB
 		vector<int> _SNPIndex;
 		/// the out-of-bag accuracy
 		double _OutOfBag_Accuracy;
+		/// the memory usage of '_BootstrapCount'
+		CdMemUsage _MemBootstrap;
+		/// the memory usage of '_Haplo'
+		CdMemUsage _MemHaplo;
+		/// the inference plan of '_Haplo' for the block prediction, compiled
+		//    by the owner at the first prediction and kept until '_Haplo' changes
+		CAlg_Prediction::TPlan _Plan;
 	};
 
 
@@ -616,7 +1234,7 @@ namespace HLA_LIB
 
 		/// build n individual classifiers with the specified parameters
 		void BuildClassifiers(int nclassifier, int mtry, bool prune,
-			bool verbose, bool verbose_detail=false);
+			bool verbose, bool verbose_detail=false, bool trace=false);
 
 		/** get the best-guess HLA types
 		 *  \param genomat
@@ -625,11 +1243,15 @@ namespace HLA_LIB
 		 *  \param OutH1
 		 *  \param OutH2
 		 *  \param OutProb
+		 *  \param OutErrBound  the error bounds in the approximate mode, or NULL
+		 *  \param OutNumClassifier  the number of classifiers evaluated for
+		 *                           each sample, or NULL
 		 *  \param ShowInfo
 		**/
 		void PredictHLA(const int *genomat, int n_samp, int vote_method,
 			int OutH1[], int OutH2[], double OutMaxProb[],
-			double OutProbArray[], bool ShowInfo);
+			double OutProbArray[], double OutErrBound[],
+			int OutNumClassifier[], bool ShowInfo);
 
 		/** get the posterior probabilities of HLA type
 		 *  \param genomat
@@ -641,6 +1263,19 @@ namespace HLA_LIB
 		void PredictHLA_Prob(const int *genomat, int n_samp, int vote_method,
 			double OutProb[], bool ShowInfo);
 
+		/** predict the out-of-bag samples of each classifier according to
+		 *    the bootstrap counts, with the classifiers in parallel
+		 *  \param genomat   the SNP genotypes of all training samples
+		 *  \param OutH1     the best-guess allele 1, a n_samp x n_classifier
+		 *                   matrix, NA_INTEGER if not predicted
+		 *  \param OutH2     the best-guess allele 2
+		 *  \param OutProb   the posterior probabilities of best guesses
+		 *  \param nThread   the number of threads
+		 *  \param ShowInfo
+		**/
+		void PredictOutOfBag(const int *genomat, int OutH1[], int OutH2[],
+			double OutProb[], int nThread, bool ShowInfo);
+
 		/// the number of samples
 		inline int nSamp() const { return _SNPMat.Num_Total_Samp; }
 		/// the number of SNPs
@@ -654,6 +1289,42 @@ namespace HLA_LIB
 		/// a list of individual classifiers
 		inline const vector<CAttrBag_Classifier> &ClassifierList() const
 			{ return _ClassifierList; }
+		/// the progress object for training and prediction
+		inline CdProgression &Progress() { return _Progress; }
+		/// the prediction algorithm
+		inline CAlg_Prediction &Prediction() { return _Predict; }
+		/** set the early exit of prediction: classifiers are evaluated in
+		 *    their stored order, and a sample stops once the remaining
+		 *    classifiers can not change its best guess, and can not move its
+		 *    averaged posterior probability by more than 'tol' (each adds a
+		 *    weight of at most one, see 'CAlg_Prediction::SettledBlock');
+		 *    tol = 0 to evaluate all classifiers
+		**/
+		void SetEarlyExit(double tol);
+		/// set the fraction of candidate SNPs evaluated by EM in training, see 'CVariableSelection::SetScreen'
+		inline void SetScreen(double frac) { _VarSelect.SetScreen(frac); }
+		/// set successive halving in training, see 'CVariableSelection::SetHalving'
+		inline void SetHalving(bool halving) { _VarSelect.SetHalving(halving); }
+		/** set the adaptive ensemble size of training: 'BuildClassifiers'
+		 *    stops once the ensemble out-of-bag accuracy and its standard
+		 *    error vary within 'tol' over the last classifiers, or once
+		 *    'max_time' seconds elapse; 0 to disable either rule; the
+		 *    out-of-bag posteriors are weighted by the non-missing SNPs as in
+		 *    prediction, with the SNP weights of the classifiers trained so
+		 *    far when each classifier is added
+		**/
+		void SetEnsembleStop(double tol, double max_time);
+		/// the ensemble out-of-bag accuracy after each classifier in the last training, if 'tol' > 0
+		inline const vector<double> &EnsembleAccuracy() const
+			{ return _EnsembleAcc; }
+		/** set the probabilities of sampling candidate SNPs in training
+		 *    proportional to positive weights (e.g., LD scores), or NULL for
+		 *    equal probabilities
+		**/
+		void SetSNPWeight(const double weight[]);
+		/// the training trace of forward-selection steps
+		inline const vector<TSearchTrace> &TrainingTrace() const
+			{ return _Trace; }
 
 	protected:
 		/// the SNP genotype matrix
@@ -666,9 +1337,47 @@ namespace HLA_LIB
 		CVariableSelection _VarSelect;
 		/// prediction algorithm
 		CAlg_Prediction _Predict;
-
-		/// prediction HLA types internally
-		void _PredictHLA(const int *geno, const int weights[], int vote_method);
+		/// the training trace
+		vector<TSearchTrace> _Trace;
+		/// the memory usage of '_HLAList'
+		CdMemUsage _MemHLA;
+		/// the memory usage of '_Trace'
+		CdMemUsage _MemTrace;
+		/// the progress information
+		CdProgression _Progress;
+		/// the tolerance of the early exit in prediction, 0 for no early exit
+		double _EarlyExitTol;
+		/// the weights of sampling candidate SNPs, empty for equal weights
+		vector<double> _SNPSampWeight;
+		/// the tolerance of the ensemble out-of-bag accuracy to stop training
+		double _StopTol;
+		/// the wall-clock budget of training in seconds, 0 for no limit
+		double _StopMaxTime;
+		/// the ensemble out-of-bag accuracies in the last training
+		vector<double> _EnsembleAcc;
+
+		/// The SNPs of a classifier as bit masks over all SNPs of the model,
+		//    used to extract the packed genotypes of the classifier
+		struct TPredMask
+		{
+			vector<int> Word;        //< the indices of 64-bit words with SNPs
+			vector<uint64_t> Mask;   //< the SNP masks of the words in 'Word'
+			vector<int> BitOrder;    //< the positions in '_SNPIndex' sorted by SNP
+			int SumWeight;           //< the sum of SNP weights
+			bool Valid;              //< false if duplicate SNPs exist
+		};
+		/// the SNP masks of classifiers for prediction
+		vector<TPredMask> _PredMask;
+		/// the number of 64-bit words for the packed genotypes of a sample
+		int _PredNumWord;
+
+		/// initialize '_PredMask' with SNP weights, and compile the inference
+		//    plans of classifiers if needed
+		void _InitPredMask(const int weights[]);
+		/// predict HLA types for a block of samples internally, and output
+		//    the number of classifiers evaluated for each sample
+		void _PredictHLABlock(const int *geno, int n_samp, const int weights[],
+			int vote_method, int OutNumClassifier[]);
 		/// get weight with respect to missing SNPs
 		void _GetSNPWeights(int OutWeight[]);
 	};
@@ -678,42 +1387,8 @@ namespace HLA_LIB
 	// ===================================================================== //
 	// ===================================================================== //
 
-	/// The basic class for progress object
-	class CdProgression
-	{
-	public:
-		static const int TotalPercent = 10;
-		static const int StepPercent = 10;
-
-		/// The associated information
-		std::string Info;
-
-		/// Constructor
-		CdProgression();
-
-		/// initialize
-		void Init(long TotalCnt, bool ShowInit);
-		/// move forward
-		bool Forward(long step, bool Show);
-		/// show progress information
-		virtual void ShowProgress();
-
-        /// Return the current percentile
-		inline int Percent() const { return fPercent; }
-		/// Return the total number
-		inline long Total() const { return fTotal; }
-		/// Return the current position
-		inline long Current() const { return fCurrent; }
-
-	protected:
-		long fTotal;      //< the total number
-		long fCurrent;    //< the current number
-		int fPercent;     //< the corresponding percent
-		clock_t OldTime;  //< the old time point
-	};
-
-	/// The progression information
-	extern CdProgression Progress;
+	/// wall-clock time in seconds
+	double WallClock();
 
 
 